@@ -1,6 +1,7 @@
 from invoke import Collection
 
 from . import bare_metal
+from . import bench
 from . import call
 from . import codegen
 from . import compile
@@ -22,6 +23,7 @@ from . import wast
 
 # Default names
 ns = Collection(
+    bench,
     codegen,
     compile,
     config,
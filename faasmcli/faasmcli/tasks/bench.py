@@ -0,0 +1,69 @@
+from os import environ, listdir, makedirs
+from os.path import join, isdir
+from subprocess import call
+from time import time
+
+from invoke import task
+
+from faasmcli.util.env import BENCHMARK_ENV, POSSIBLE_BUILD_BINS, RESULT_DIR, WASM_DIR
+from faasmcli.util.shell import find_command
+
+POLYBENCH_USER = "polybench"
+
+# Page sizes to compare, and the HUGE_PAGES setting for each
+PAGE_MODES = {
+    "4KB": "off",
+    "2MB": "on",
+}
+
+
+def _time_function(runner, user, func, repeats, huge_pages):
+    env = dict(environ)
+    env.update(BENCHMARK_ENV)
+    env["HUGE_PAGES"] = huge_pages
+
+    cmd = [runner, user, func, str(repeats)]
+
+    start = time()
+    res = call(" ".join(cmd), shell=True, env=env)
+    elapsed = time() - start
+
+    if res != 0:
+        raise RuntimeError("Failed running {}/{}".format(user, func))
+
+    return elapsed / repeats
+
+
+@task
+def huge_pages(ctx, func=None, repeats=5):
+    """
+    Compare polybench run times with 4KB and 2MB (transparent huge) pages
+    """
+    user_dir = join(WASM_DIR, POLYBENCH_USER)
+    if func:
+        funcs = [func]
+    elif isdir(user_dir):
+        funcs = sorted(listdir(user_dir))
+    else:
+        print("No polybench functions found at {}, compile them first".format(user_dir))
+        exit(1)
+
+    runner = find_command("simple_runner", POSSIBLE_BUILD_BINS)
+
+    makedirs(RESULT_DIR, exist_ok=True)
+    result_file = join(RESULT_DIR, "huge_pages.csv")
+
+    with open(result_file, "w") as fh:
+        fh.write("function,pages,seconds_per_run\n")
+
+        print("{:<25} {:>12} {:>12} {:>10}".format("Function", "4KB (s)", "2MB (s)", "Speed-up"))
+        for f in funcs:
+            times = dict()
+            for page_size, mode in PAGE_MODES.items():
+                times[page_size] = _time_function(runner, POLYBENCH_USER, f, repeats, mode)
+                fh.write("{},{},{:.4f}\n".format(f, page_size, times[page_size]))
+
+            speed_up = times["4KB"] / times["2MB"] if times["2MB"] > 0 else 0
+            print("{:<25} {:>12.4f} {:>12.4f} {:>9.2f}x".format(f, times["4KB"], times["2MB"], speed_up))
+
+    print("Results written to {}".format(result_file))
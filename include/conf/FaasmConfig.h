@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace conf {
+    /**
+     * Faasm-specific runtime configuration, read from the environment. General
+     * system configuration (hosts, timeouts, storage etc.) lives in the faabric
+     * SystemConfig.
+     */
+    class FaasmConfig {
+    public:
+        // Zygote resets
+        std::string zygoteResetMode;
+        std::string asyncModuleReset;
+
+        // Module cache
+        int moduleCacheMaxMb;
+        int hotZygoteCalls;
+        std::string preloadDynamicModules;
+
+        // Code generation
+        std::string objectCacheDir;
+        int codegenThreads;
+        std::string tieredExecution;
+
+        // Memory
+        int memoryReservePercent;
+        std::string hugePages;
+        std::string hugePagesFunctions;
+
+        // Threads
+        std::string threadMemoryMerge;
+        int threadStackKb;
+        std::string threadStackKbOverrides;
+        std::string threadStackGuard;
+
+        FaasmConfig();
+
+        int getThreadStackKb(const std::string &user, const std::string &function);
+
+        bool useHugePages(const std::string &user, const std::string &function);
+
+        void reset();
+
+        void print();
+
+    private:
+        std::unordered_map<std::string, int> threadStackKbByFunction;
+        std::unordered_set<std::string> hugePagesFunctionSet;
+
+        void initialise();
+    };
+
+    FaasmConfig &getFaasmConfig();
+}
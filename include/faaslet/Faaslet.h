@@ -1,5 +1,6 @@
 #pragma once
 
+#include <faaslet/ModuleResetWorker.h>
 #include <system/NetworkNamespace.h>
 
 #include <faabric/util/func.h>
@@ -7,6 +8,7 @@
 
 #include <wasm/WasmModule.h>
 
+#include <future>
 #include <string>
 
 namespace faaslet {
@@ -31,9 +33,16 @@ namespace faaslet {
         const int threadIdx;
 
         std::unique_ptr<wasm::WasmModule> module;
+
+        std::unique_ptr<wasm::WasmModule> spareModule;
+
+        bool isInterpreted();
     private:
         bool _isBound = false;
 
+        // Set while running in the interpreter waiting for WAVM codegen to finish
+        bool interpreted = false;
+
         int isolationIdx;
         std::unique_ptr<isolation::NetworkNamespace> ns;
 
@@ -45,6 +54,16 @@ namespace faaslet {
 
         std::shared_ptr<faabric::scheduler::InMemoryMessageQueue> currentQueue;
 
+        std::future<void> pendingReset;
+
+        // Must be declared after the modules so it's destroyed (finishing any reset)
+        // first. Held by pointer so the Faaslet can still be moved.
+        std::unique_ptr<ModuleResetWorker> resetWorker;
+
+        void awaitPendingReset();
+
+        void resetModule(const faabric::Message &msg);
+
         std::string executeCall(faabric::Message &msg);
 
         void finishCall(faabric::Message &msg, bool success, const std::string &errorMsg);
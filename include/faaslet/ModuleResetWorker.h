@@ -0,0 +1,31 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+
+namespace faaslet {
+    /**
+     * Runs a Faaslet's module resets in the background, in order, on a single thread
+     * that lives as long as the worker rather than one thread per reset. The thread is
+     * only started when the first reset is submitted.
+     */
+    class ModuleResetWorker {
+    public:
+        ~ModuleResetWorker();
+
+        std::future<void> submit(std::function<void()> task);
+
+    private:
+        std::thread thread;
+        std::mutex mx;
+        std::condition_variable cv;
+        std::deque<std::packaged_task<void()>> tasks;
+        bool stopping = false;
+
+        void run();
+    };
+}
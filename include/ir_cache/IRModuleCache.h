@@ -3,7 +3,12 @@
 #include <WAVM/Runtime/Intrinsics.h>
 #include <WAVM/IR/Module.h>
 
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <shared_mutex>
+#include <vector>
 #include <faabric/util/config.h>
 
 // Note that page size in wasm is 64kiB
@@ -23,6 +28,8 @@ namespace wasm {
     public:
         IRModuleCache();
 
+        ~IRModuleCache();
+
         IR::Module &getModule(const std::string &user, const std::string &func, const std::string &path);
 
         Runtime::ModuleRef getCompiledModule(const std::string &user, const std::string &func,
@@ -31,12 +38,28 @@ namespace wasm {
         U64 getSharedModuleTableSize(const std::string &user, const std::string &func,
                                      const std::string &path);
 
+        bool prepareCompiledMainModule(const std::string &user, const std::string &func);
+
+        void awaitBackgroundCompiles();
+
+        void clear();
+
     private:
+        // Only held to look up or add entries, loading happens outside the lock. Entries are
+        // futures so callers for a key that's still loading can wait on the one load.
         std::shared_mutex registryMutex;
-        std::unordered_map<std::string, IR::Module> moduleMap;
-        std::unordered_map<std::string, Runtime::ModuleRef> compiledModuleMap;
+        std::unordered_map<std::string, std::shared_future<std::shared_ptr<IR::Module>>> moduleMap;
+        std::unordered_map<std::string, std::shared_future<Runtime::ModuleRef>> compiledModuleMap;
         std::unordered_map<std::string, int> originalTableSizes;
 
+        // Compiles started by prepareCompiledMainModule, owned here so they can be waited
+        // on rather than outliving the cache
+        std::mutex backgroundMutex;
+        std::vector<std::future<void>> backgroundCompiles;
+
+        // Content hashes of the wasm for each module, used to look up the object cache
+        std::unordered_map<std::string, std::string> objectCacheKeys;
+
         faabric::util::SystemConfig &conf;
 
         int getModuleCount(const std::string &key);
@@ -51,6 +74,11 @@ namespace wasm {
 
         Runtime::ModuleRef getCompiledSharedModule(const std::string &user, const std::string &func,
                 const std::string &path);
+
+        void setObjectCacheKey(const std::string &key, const std::vector<uint8_t> &wasmBytes);
+
+        Runtime::ModuleRef loadCompiledModule(const std::string &key, IR::Module &module,
+                                              const std::function<Runtime::ModuleRef()> &loadUncached);
     };
 
     IRModuleCache &getIRModuleCache();
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <WAVM/IR/FeatureSpec.h>
+
+// Bump when anything affecting generated code changes other than the WAVM and LLVM
+// builds, the features and the target, which are all part of the key
+#define OBJECT_CACHE_VERSION 2
+
+namespace wasm {
+    /**
+     * Read-only mapping of an object file in the cache, unmapped on destruction
+     */
+    class MappedObjectFile {
+    public:
+        MappedObjectFile(const uint8_t *data, size_t size);
+
+        ~MappedObjectFile();
+
+        MappedObjectFile(const MappedObjectFile &other) = delete;
+
+        MappedObjectFile &operator=(const MappedObjectFile &other) = delete;
+
+        const uint8_t *data() const;
+
+        size_t size() const;
+
+    private:
+        const uint8_t *_data;
+        size_t _size;
+    };
+
+    /**
+     * On-disk cache of compiled object code, keyed by a hash of the wasm bytes and the
+     * codegen options. Functions with identical wasm share a single object file, and
+     * the cache survives restarts and is shared between processes on the same host.
+     *
+     * Files are written to a temporary path and renamed into place, so readers never
+     * see partial files.
+     */
+    class ObjectCache {
+    public:
+        explicit ObjectCache(const std::string &dirIn);
+
+        bool isEnabled();
+
+        std::string getObjectPath(const std::string &key);
+
+        std::shared_ptr<MappedObjectFile> load(const std::string &key);
+
+        void store(const std::string &key, const std::vector<uint8_t> &objBytes);
+
+    private:
+        std::string dir;
+    };
+
+    void setCodegenFeatures(WAVM::IR::FeatureSpec &featureSpec);
+
+    std::string getObjectCacheKey(const std::vector<uint8_t> &wasmBytes);
+
+    ObjectCache &getObjectCache();
+}
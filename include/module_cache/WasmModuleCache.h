@@ -2,23 +2,81 @@
 
 #include <wavm/WAVMWasmModule.h>
 
+#include <atomic>
+#include <memory>
+#include <vector>
+
 namespace module_cache {
+    /**
+     * Memory accounting for a single cached module. The zygote's own linear memory and
+     * the memfd holding its copy-on-write image are both resident, so both are counted.
+     * Only allocated bytes are counted, i.e. the zygote's private pages and the fd's
+     * blocks, so untouched memory and holes in the fd cost nothing.
+     */
+    struct CachedModuleUsage {
+        size_t memoryBytes = 0;
+        size_t fdBytes = 0;
+        uint64_t hits = 0;
+        bool hot = false;
+    };
+
     class WasmModuleCache {
     public:
-        wasm::WAVMWasmModule &getCachedModule(const faabric::Message &msg);
+        std::shared_ptr<wasm::WAVMWasmModule> getCachedModule(const faabric::Message &msg);
 
         void clear();
 
         size_t getTotalCachedModuleCount();
+
+        size_t getTotalCachedBytes();
+
+        bool isCached(const faabric::Message &msg);
+
+        CachedModuleUsage getCachedModuleUsage(const faabric::Message &msg);
+
+        bool recordSuccessfulCall(const faabric::Message &msg, const wasm::WAVMWasmModule &module);
+
+        bool recordDynamicModules(const faabric::Message &msg, const wasm::WAVMWasmModule &module);
     private:
+        struct CachedModuleEntry {
+            std::shared_ptr<wasm::WAVMWasmModule> module;
+            CachedModuleUsage usage;
+
+            // Updated under a shared lock, hence atomic
+            std::atomic<uint64_t> lastUsed = 0;
+            std::atomic<uint64_t> hits = 0;
+
+            // Base zygotes are replaced once warmed up by enough successful calls
+            std::atomic<uint64_t> successfulCalls = 0;
+            bool hot = false;
+
+            // Set while the zygote is being rebuilt with preloaded dynamic modules
+            std::atomic<bool> rebuilding = false;
+        };
+
         std::shared_mutex mx;
-        std::unordered_map<std::string, wasm::WAVMWasmModule> cachedModuleMap;
+        std::unordered_map<std::string, CachedModuleEntry> cachedModuleMap;
+        size_t totalCachedBytes = 0;
+
+        std::atomic<uint64_t> useCounter = 0;
 
         std::string getCachedModuleKey(const faabric::Message &msg);
 
         std::string getBaseCachedModuleKey(const faabric::Message &msg);
 
-        int getCachedModuleCount(const std::string &key);
+        std::shared_ptr<wasm::WAVMWasmModule> getCachedModuleIfExists(const std::string &key);
+
+        std::shared_ptr<wasm::WAVMWasmModule> addCachedModule(
+                const std::string &key,
+                const std::shared_ptr<wasm::WAVMWasmModule> &module
+        );
+
+        void replaceCachedModule(const std::string &key, const std::shared_ptr<wasm::WAVMWasmModule> &module,
+                                 bool hot);
+
+        std::vector<std::shared_ptr<wasm::WAVMWasmModule>> evictIfNeeded(const std::string &keepKey);
+
+        void clearRebuilding(const std::string &key, const std::shared_ptr<wasm::WAVMWasmModule> &oldZygote);
     };
 
     WasmModuleCache &getWasmModuleCache();
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace storage {
+    enum class CodegenOutcome {
+        GENERATED,
+        SKIPPED,
+        FAILED,
+    };
+
+    /**
+     * Runs a batch of codegen jobs across a pool of threads, largest first so that big
+     * modules don't end up running on their own at the end. Jobs return true if they
+     * generated code, or false if they skipped it, and throw if they failed.
+     */
+    class CodegenPool {
+    public:
+        explicit CodegenPool(int nThreadsIn = 0);
+
+        void addJob(const std::string &name, uintmax_t size, std::function<bool()> func);
+
+        void run();
+
+        void printReport();
+
+        int getFailedCount();
+
+    private:
+        struct Job {
+            std::string name;
+            uintmax_t size = 0;
+            std::function<bool()> func;
+
+            CodegenOutcome outcome = CodegenOutcome::SKIPPED;
+            double durationMs = 0;
+        };
+
+        unsigned int nThreads;
+        std::vector<Job> jobs;
+        double totalDurationMs = 0;
+    };
+}
@@ -36,9 +36,9 @@ namespace storage {
 
         virtual void uploadSharedFile(const std::string &path, const std::vector<uint8_t> &fileBytes) = 0;
 
-        void codegenForFunction(faabric::Message &msg);
+        bool codegenForFunction(faabric::Message &msg, bool skipIfUnchanged = false);
 
-        void codegenForSharedObject(const std::string &inputPath);
+        bool codegenForSharedObject(const std::string &inputPath, bool skipIfUnchanged = false);
 
     protected:
         std::vector<uint8_t> doCodegen(std::vector<uint8_t> &bytes);
@@ -50,6 +50,12 @@ namespace storage {
 
     std::vector<uint8_t> loadFileBytes(const std::string &path);
 
+    std::string getCodegenHash(const std::vector<uint8_t> &wasmBytes);
+
+    bool isCodegenUpToDate(const std::string &objectFilePath, const std::string &hash);
+
+    void writeCodegenHash(const std::string &objectFilePath, const std::string &hash);
+
     class SharedFileIsDirectoryException : public faabric::util::FaabricException {
     public:
         explicit SharedFileIsDirectoryException(const std::string &filePath) :
@@ -25,6 +25,10 @@ namespace wasm {
 
         void bindToFunctionNoZygote(const faabric::Message &msg) override;
 
+        void bindToFunctionInterpreted(const faabric::Message &msg);
+
+        bool allImportsResolved();
+
         bool execute(faabric::Message &msg, bool forceNoop = false) override;
 
         bool isBound() override;
@@ -44,11 +48,15 @@ namespace wasm {
 
         std::vector<char> errorBuffer;
 
-        WASMModuleCommon *wasmModule;
-        WASMModuleInstanceCommon *moduleInstance;
-        WASMExecEnv *executionEnv;
+        std::vector<uint8_t> moduleBytes;
+
+        WASMModuleCommon *wasmModule = nullptr;
+        WASMModuleInstanceCommon *moduleInstance = nullptr;
+        WASMExecEnv *executionEnv = nullptr;
+
+        void loadAndInstantiate(const faabric::Message &msg, std::vector<uint8_t> bytes, uint32_t expectedType);
 
-        void executeFunction(const std::string &funcName);
+        bool executeFunction(const std::string &funcName);
     };
 
     void tearDownWAMRGlobally();
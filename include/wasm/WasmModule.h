@@ -1,6 +1,7 @@
 #pragma once
 
 #include "WasmEnvironment.h"
+#include "serialisation.h"
 
 #include <faabric/util/logging.h>
 #include <faabric/state/State.h>
@@ -96,14 +97,20 @@ namespace wasm {
         // ----- Snapshot/ restore -----
         void snapshotToFile(const std::string &filePath);
 
+        void snapshotToMappableFile(const std::string &filePath);
+
         std::vector<uint8_t> snapshotToMemory();
 
+        size_t snapshotToMemory(uint8_t *buffer, size_t bufferSize);
+
         size_t snapshotToState(const std::string &stateKey);
 
         void restoreFromFile(const std::string &filePath);
 
         void restoreFromMemory(const std::vector<uint8_t> &data);
 
+        void restoreFromMemory(const uint8_t *data, size_t dataSize);
+
         void restoreFromState(const std::string &stateKey, size_t stateSize);
 
     protected:
@@ -125,10 +132,18 @@ namespace wasm {
 
         int getStdoutFd();
 
+        virtual size_t prepareSnapshot();
+
+        size_t writeSnapshotToState(const std::string &stateKey, size_t stateSize);
+
         virtual void doSnapshot(std::ostream &outStream);
 
         virtual void doRestore(std::istream &inStream);
 
+        virtual void doSnapshotToMappableFile(int fd);
+
+        virtual void doRestoreFromMappableFile(int fd, const MappableSnapshotHeader &header);
+
         void prepareArgcArgv(const faabric::Message &msg);
 
         // Shared memory regions
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace wasm {
+    /**
+     * A contiguous range of host pages, expressed as a byte offset and length
+     * relative to some base address (usually the base of a linear memory).
+     */
+    typedef std::pair<size_t, size_t> PageRange;
+
+    /**
+     * Returns the ranges of host pages in the given region which have been written
+     * since they were mapped privately from a file. Relies on the fact that a write to a
+     * MAP_PRIVATE file mapping replaces the file page with an anonymous copy, which is
+     * visible in /proc/self/pagemap. Untouched and read-only pages are not included.
+     */
+    std::vector<PageRange> getDirtyPageRanges(const uint8_t *base, size_t nBytes);
+
+    /**
+     * Returns the ranges of host pages in the given region which have been populated,
+     * i.e. are resident or swapped. For anonymous memory, any page outside these ranges
+     * has never been touched so must be zero.
+     */
+    std::vector<PageRange> getPopulatedPageRanges(const uint8_t *base, size_t nBytes);
+
+    /**
+     * Tracks which host pages of a region are written, using the kernel's soft-dirty
+     * bits (see https://www.kernel.org/doc/Documentation/admin-guide/mm/soft-dirty.rst).
+     * The bits are per process, and clearing them for one region clears them for all, so
+     * only one tracker can use them at a time. Any other tracker, or any tracker where
+     * the kernel doesn't support them, reports the whole region as written.
+     */
+    class SoftDirtyTracker {
+    public:
+        SoftDirtyTracker() = default;
+
+        SoftDirtyTracker(const SoftDirtyTracker &) = delete;
+
+        SoftDirtyTracker &operator=(const SoftDirtyTracker &) = delete;
+
+        ~SoftDirtyTracker();
+
+        /**
+         * Starts tracking afresh, i.e. only pages written after this are reported
+         */
+        void reset();
+
+        /**
+         * Returns the ranges of host pages in the region written since the last reset,
+         * then resets.
+         */
+        std::vector<PageRange> getDirtyPageRangesAndReset(const uint8_t *base, size_t nBytes);
+
+        /**
+         * Adds changes the bits can't see, e.g. pages discarded with madvise, which are
+         * no longer mapped so have no bits.
+         */
+        void markDirty(const PageRange &range);
+
+        /**
+         * Stops tracking, letting another tracker use the bits
+         */
+        void release();
+
+        bool isTracking() const;
+
+    private:
+        bool tracking = false;
+
+        std::vector<PageRange> markedRanges;
+    };
+
+    /**
+     * Writes the non-zero host pages in the given range to the fd at the same offsets,
+     * so zero pages are left as holes (assuming the fd has already been sized). Returns
+     * the number of bytes written.
+     */
+    size_t writeNonZeroPages(int fd, const uint8_t *base, const PageRange &range);
+
+    /**
+     * Returns the page-aligned ranges of the file containing data, found with
+     * SEEK_DATA/SEEK_HOLE. Holes smaller than the given size are included in the
+     * surrounding ranges. If the file system can't report holes the whole file is
+     * returned.
+     */
+    std::vector<PageRange> getFileDataRanges(int fd, size_t fileSize, size_t minHoleSize);
+
+    /**
+     * Discards the given page ranges with MADV_DONTNEED. For a MAP_PRIVATE file mapping
+     * this reverts the pages to the file contents, for anonymous memory to zeroes.
+     */
+    void discardPageRanges(uint8_t *base, const std::vector<PageRange> &ranges);
+
+    /**
+     * A run of changed bytes, expressed as an offset relative to some base address and
+     * a length.
+     */
+    typedef std::pair<uint32_t, uint32_t> ByteRun;
+
+    /**
+     * Appends the runs of bytes in [start, end) where the memory differs from the
+     * reference. If the reference is null the memory is compared against zeroes.
+     * Runs are exact, so applying them won't touch any unchanged bytes in between.
+     */
+    void findChangedBytes(const uint8_t *memBase, const uint8_t *refBase, size_t start, size_t end,
+                          std::vector<ByteRun> &runs);
+
+    /**
+     * Memory diffs are serialised as a run count followed by each run's offset, length
+     * and contents, all taken from the given memory.
+     */
+    std::vector<uint8_t> serialiseMemoryDiff(const uint8_t *memBase, const std::vector<ByteRun> &runs);
+
+    /**
+     * Returns the size of memory needed to apply the given diff.
+     */
+    size_t getMemoryDiffExtent(const uint8_t *diff, size_t diffSize);
+
+    /**
+     * Writes the changed bytes from the diff into memory, leaving all other bytes as
+     * they are. Returns the number of bytes written.
+     */
+    size_t applyMemoryDiff(uint8_t *memBase, size_t memSize, const uint8_t *diff, size_t diffSize);
+}
@@ -1,19 +1,148 @@
 #ifndef FAASM_SERIALISATION_H
 #define FAASM_SERIALISATION_H
 
-#include <cereal/types/vector.hpp>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// "FSNP"
+#define SNAPSHOT_MAGIC 0x504e5346
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_CHUNK_SIZE 4096
+
+// Reserved, no compression codec is implemented yet
+#define SNAPSHOT_FLAG_COMPRESSED 1
+
+// Only contains chunks changed since a previous snapshot
+#define SNAPSHOT_FLAG_DELTA 2
+
+// "FSNM"
+#define MAPPABLE_SNAPSHOT_MAGIC 0x4d4e5346
+#define MAPPABLE_SNAPSHOT_VERSION 1
+
+// Reserved in snapshot keys to mark versions and deltas, so can't appear in base keys
+#define SNAPSHOT_KEY_SEPARATOR '#'
 
 namespace wasm {
-    class MemorySerialised {
+    /**
+     * Snapshots of linear memory are written as a header followed by a list of records
+     * describing the non-zero chunks of memory. Chunks which are all zero are left out
+     * entirely, and chunks identical to an earlier chunk are written as a reference to
+     * that chunk.
+     *
+     * DATA records are followed by the contents of their chunks, DUPLICATE records by
+     * nothing (the source chunk is in the record itself).
+     *
+     * Delta snapshots are applied on top of the snapshot they were taken against, so
+     * any chunk without a record is unchanged rather than zero, and chunks which have
+     * since been zeroed get a ZERO record.
+     *
+     * The stack pointer is that of the caller taking the snapshot, so anything restored
+     * from it can run its own frames below the caller's. Zero if not recorded.
+     */
+    struct SnapshotHeader {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t flags;
+        uint32_t chunkSize;
+        uint32_t stackPointer;
+        uint64_t numPages;
+        uint64_t numRecords;
+    };
+
+    enum SnapshotRecordType : uint32_t {
+        SNAPSHOT_RECORD_DATA = 1,
+        SNAPSHOT_RECORD_DUPLICATE = 2,
+        SNAPSHOT_RECORD_ZERO = 3,
+    };
+
+    struct SnapshotRecord {
+        uint64_t chunkIdx;
+        uint32_t nChunks;
+        uint32_t type;
+        uint64_t sourceChunkIdx;
+    };
+
+    /**
+     * Alternative on-disk layout which can be mapped straight into memory. The header
+     * is padded out to a host page, followed by an uncompressed image of the whole of
+     * linear memory. All-zero chunks aren't written, so are left as holes in the file.
+     */
+    struct MappableSnapshotHeader {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t flags;
+        uint64_t numPages;
+        uint64_t dataOffset;
+    };
+
+    /**
+     * Working out what to write is done up front, so the size of the snapshot is known
+     * before writing any of it.
+     */
+    class SnapshotPlan {
+    public:
+        size_t numPages = 0;
+        uint16_t flags = 0;
+        uint32_t stackPointer = 0;
+        std::vector<SnapshotRecord> records;
+
+        size_t getSerialisedSize() const;
+
+        size_t getDataChunkCount() const;
+    };
+
+    /**
+     * Stream buffer over a fixed region of memory (e.g. a state value or a caller's
+     * buffer), so snapshots can be written and read in place without intermediate
+     * copies. Writing past the end of the region fails the stream.
+     */
+    class MemoryRegionBuf : public std::streambuf {
     public:
-        size_t numPages;
-        std::vector<uint8_t> data;
+        MemoryRegionBuf(uint8_t *data, size_t size);
 
-        template<class Archive>
-        void serialize(Archive &ar)  {
-            ar(numPages, data);
-        }
+        size_t bytesWritten() const;
     };
+
+    /**
+     * Copies of chunks as of the last snapshot, by chunk index. Only chunks written
+     * since the snapshot before that are kept, as they're the ones likely to be written
+     * again, so this is bounded by the working set rather than the size of memory.
+     */
+    typedef std::unordered_map<uint64_t, std::vector<uint8_t>> SnapshotImage;
+
+    SnapshotPlan planMemorySnapshot(const uint8_t *memBase, size_t numPages);
+
+    SnapshotPlan planMemorySnapshotDelta(const uint8_t *memBase, size_t numPages,
+                                         const std::vector<std::pair<size_t, size_t>> &dirtyRanges,
+                                         SnapshotImage &image);
+
+    void writeMemorySnapshot(const SnapshotPlan &plan, const uint8_t *memBase, std::ostream &outStream);
+
+    SnapshotHeader readMemorySnapshotHeader(std::istream &inStream);
+
+    void readMemorySnapshot(const SnapshotHeader &header, std::istream &inStream, uint8_t *memBase);
+
+    void writeMappableSnapshot(int fd, const uint8_t *memBase, size_t numPages);
+
+    bool readMappableSnapshotHeader(int fd, MappableSnapshotHeader &header);
+
+    void mapMappableSnapshot(int fd, const MappableSnapshotHeader &header, uint8_t *memBase);
+
+    // ----- Versioned snapshot keys -----
+
+    std::string getVersionedSnapshotKey(const std::string &baseKey, int version);
+
+    std::string getSnapshotDeltaKey(const std::string &baseKey, int version);
+
+    bool parseVersionedSnapshotKey(const std::string &key, std::string &baseKey, int &version);
+
+    std::string getThreadMemoryDiffKey(const std::string &snapshotKey, unsigned int callId);
 }
 
 #endif
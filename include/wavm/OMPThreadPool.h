@@ -34,6 +34,9 @@ namespace wasm {
             std::queue<std::pair<std::promise<WAVM::I64>, openmp::LocalThreadArgs>> tasks;
             std::vector<WAVM::Platform::Thread *> workers;
 
+            WAVMWasmModule *module;
+            std::vector<uint32_t> stacks;
+
             std::mutex mutexQueue;
             std::condition_variable condition;
             bool stop = false;
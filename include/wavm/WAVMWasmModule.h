@@ -1,11 +1,15 @@
 #pragma once
 
 #include <wasm/WasmModule.h>
+#include <wasm/memory_util.h>
 
 #include <WAVM/Runtime/Intrinsics.h>
 #include <WAVM/Runtime/Linker.h>
 #include <WAVM/Runtime/Runtime.h>
 
+#include <mutex>
+#include <unordered_set>
+
 namespace wasm {
     WAVM_DECLARE_INTRINSIC_MODULE(env)
 
@@ -49,6 +53,18 @@ namespace wasm {
 
         uint32_t mmapFile(uint32_t fp, uint32_t length) override;
 
+        int munmapMemory(uint32_t offset, uint32_t length);
+
+        int adviseMemory(uint32_t offset, uint32_t length, int advice);
+
+        size_t getFreeMemoryBytes();
+
+        uint32_t getMemoryBreak();
+
+        int32_t moveMemoryBreak(uint32_t target, bool relative);
+
+        uint32_t getStackPointer() const;
+
         uint8_t* wasmPointerToNative(int32_t wasmPtr) override;
 
         // ----- Environment variables
@@ -59,6 +75,18 @@ namespace wasm {
 
         void mapMemoryFromFd() override;
 
+        size_t getMemoryFdSize();
+
+        size_t getMemoryFdAllocatedBytes();
+
+        size_t getPrivateMemoryBytes();
+
+        bool resetDirtyPages(const WAVMWasmModule &zygote);
+
+        std::vector<uint8_t> getMemoryDiff(const WAVMWasmModule &zygote, size_t excludeBelow);
+
+        void applyMemoryDiff(const uint8_t *diff, size_t diffSize);
+
         // ----- Internals -----
         WAVM::Runtime::GCPointer<WAVM::Runtime::Memory> defaultMemory;
 
@@ -102,8 +130,14 @@ namespace wasm {
 
         uint32_t getDynamicModuleFunction(int handle, const std::string &funcName);
 
+        bool dynamicUnloadModule(int handle);
+
         int getDynamicModuleCount();
 
+        std::vector<std::string> getDynamicModulePaths() const;
+
+        void preloadDynamicModules(const std::vector<std::string> &paths);
+
         uint32_t addFunctionToTable(WAVM::Runtime::Object *exportedFunc);
 
         int getNextMemoryBase();
@@ -118,13 +152,29 @@ namespace wasm {
 
         uint32_t allocateThreadStack();
 
+        void releaseThreadStack(uint32_t stackBase);
+
+        uint32_t getThreadStackSize();
+
+        size_t getFreeThreadStackCount();
+
+        // ----- Thread snapshots -----
+        size_t snapshotIncrementalToState(const std::string &baseKey, std::string &snapshotKey,
+                                          uint32_t stackPointer = 0);
+
         std::unique_ptr<openmp::PlatformThreadPool> &getOMPPool();
 
     protected:
+        size_t prepareSnapshot() override;
+
         void doSnapshot(std::ostream &outStream) override;
 
         void doRestore(std::istream &inStream) override;
 
+        void doSnapshotToMappableFile(int fd) override;
+
+        void doRestoreFromMappableFile(int fd, const MappableSnapshotHeader &header) override;
+
     private:
         WAVM::Runtime::GCPointer<WAVM::Runtime::Instance> envModule;
         WAVM::Runtime::GCPointer<WAVM::Runtime::Instance> wasiModule;
@@ -139,13 +189,101 @@ namespace wasm {
         int memoryFd = -1;
         size_t memoryFdSize = 0;
 
+        // Fd numbers can be reused once a zygote is evicted, this identifies the contents
+        uint64_t memoryFdGeneration = 0;
+
+        // Guards the free list, the break, the thread stack pool and the size of memory,
+        // as guest threads may map and unmap memory concurrently
+        std::mutex memoryMx;
+
+        // Unmapped ranges of memory available for reuse by mmap (offset to length)
+        std::map<uint32_t, uint32_t> freeMemoryRanges;
+
+        // Set when a range mapped from the fd has been unmapped, i.e. it no longer reads
+        // back as the fd's contents
+        bool unmappedFromFd = false;
+
+        uint32_t doMmapMemory(uint32_t length);
+
+        uint32_t doMmapPages(uint32_t pages);
+
+        bool takeFreeMemoryRange(uint32_t length, uint32_t &offset);
+
+        void addFreeMemoryRange(uint32_t offset, uint32_t length);
+
+        // Size of memory before anything was mapped
+        WAVM::Uptr initialMemoryPages = 0;
+
+        // End of the pages handed out by mmap/brk, and of those grown so far. Pages in
+        // between are reserved for later mmaps.
+        WAVM::Uptr memoryBreakPages = 0;
+        WAVM::Uptr memoryReservedPages = 0;
+
+        WAVM::Uptr growMemoryPages(WAVM::Uptr pages);
+
+        void syncMemoryBreak();
+
+        void resetMemoryBreak();
+
+        void resetFreeMemory();
+
+        // Stacks for local threads, all of the same size. Stacks go back in the pool when
+        // their thread finishes, so threads spawned in a loop don't keep growing memory.
+        uint32_t threadStackSize = 0;
+        bool threadStackGuard = false;
+        std::vector<uint32_t> freeThreadStacks;
+
+        // Whether linear memory should be backed by transparent huge pages
+        bool hugePages = false;
+
+        void adviseHugePages(WAVM::Uptr offset, WAVM::Uptr length);
+
+        WAVM::Uptr getMaxMemoryBytes();
+
         bool _isBound = false;
         bool boundIsTypescript = false;
 
+        // Plan made by prepareSnapshot, used by the next doSnapshot
+        std::unique_ptr<wasm::SnapshotPlan> preparedSnapshot;
+
+        // Incremental snapshots. Pages written since the last version pushed are tracked,
+        // and the image holds copies of those written before it.
+        std::string incrementalSnapshotKey;
+        int incrementalSnapshotVersion = 0;
+        wasm::SnapshotImage incrementalSnapshotImage;
+        wasm::SoftDirtyTracker incrementalSnapshotTracker;
+
+        void resetIncrementalSnapshot();
+
         // Map of dynamically loaded modules
         std::unordered_map<std::string, int> dynamicPathToHandleMap;
         std::unordered_map<int, WAVM::Runtime::GCPointer<WAVM::Runtime::Instance>> dynamicModuleMap;
 
+        // Handle of the first dynamic module to export each name. Shared between clones
+        // and copied before being modified if shared.
+        std::shared_ptr<std::unordered_map<std::string, int>> dynamicExportIndex;
+
+        // Table slots we've added functions to, outside of any module's own elements
+        std::unordered_map<WAVM::Runtime::Object *, WAVM::Uptr> functionTableSlots;
+        std::vector<WAVM::Uptr> freeTableSlots;
+
+        // Slots referenced from a module's GOT must outlive any dlclose
+        std::unordered_set<WAVM::Uptr> pinnedTableSlots;
+
+        // Slots handed out by dlsym for each handle, freed when it's fully closed
+        std::unordered_map<int, std::unordered_set<WAVM::Uptr>> dynamicModuleSymbolSlots;
+        std::unordered_map<int, int> dynamicModuleOpenCounts;
+
+        // Bumped whenever a table slot is allocated or freed, so resets can tell the table
+        // has diverged from the zygote's
+        uint64_t dynamicLinkChanges = 0;
+
+        WAVM::Uptr allocateTableSlot();
+
+        void addToDynamicExportIndex(int handle, const WAVM::IR::Module &irModule);
+
+        WAVM::Runtime::Object *getDynamicModuleExport(const std::string &name);
+
         // Dynamic linking tables and memories
         std::unordered_map<std::string, WAVM::Uptr> globalOffsetTableMap;
         std::unordered_map<std::string, int> globalOffsetMemoryMap;
@@ -0,0 +1,107 @@
+#include "FaasmConfig.h"
+
+#include <faabric/util/environment.h>
+#include <faabric/util/logging.h>
+
+#include <sstream>
+
+using namespace faabric::util;
+
+namespace conf {
+    FaasmConfig &getFaasmConfig() {
+        static FaasmConfig conf;
+        return conf;
+    }
+
+    FaasmConfig::FaasmConfig() {
+        this->initialise();
+    }
+
+    void FaasmConfig::initialise() {
+        // Zygote resets
+        zygoteResetMode = getEnvVar("ZYGOTE_RESET_MODE", "clone");
+        asyncModuleReset = getEnvVar("ASYNC_MODULE_RESET", "off");
+
+        // Module cache
+        moduleCacheMaxMb = std::stoi(getEnvVar("MODULE_CACHE_MAX_MB", "0"));
+        hotZygoteCalls = std::stoi(getEnvVar("HOT_ZYGOTE_CALLS", "0"));
+        preloadDynamicModules = getEnvVar("PRELOAD_DYNAMIC_MODULES", "off");
+
+        // Code generation
+        objectCacheDir = getEnvVar("OBJECT_CACHE_DIR", "");
+        codegenThreads = std::stoi(getEnvVar("CODEGEN_THREADS", "0"));
+        tieredExecution = getEnvVar("TIERED_EXECUTION", "off");
+
+        // Memory
+        memoryReservePercent = std::stoi(getEnvVar("MEMORY_RESERVE_PERCENT", "0"));
+        hugePages = getEnvVar("HUGE_PAGES", "off");
+        hugePagesFunctions = getEnvVar("HUGE_PAGES_FUNCTIONS", "");
+
+        // Functions are a comma-separated list of <user>/<function>
+        hugePagesFunctionSet.clear();
+        std::stringstream functions(hugePagesFunctions);
+        std::string function;
+        while (std::getline(functions, function, ',')) {
+            if (!function.empty()) {
+                hugePagesFunctionSet.insert(function);
+            }
+        }
+
+        // Threads
+        threadMemoryMerge = getEnvVar("THREAD_MEMORY_MERGE", "off");
+        threadStackKb = std::stoi(getEnvVar("THREAD_STACK_KB", "2048"));
+        threadStackKbOverrides = getEnvVar("THREAD_STACK_KB_OVERRIDES", "");
+        threadStackGuard = getEnvVar("THREAD_STACK_GUARD", "off");
+
+        // Overrides are a comma-separated list of <user>/<function>:<kb>
+        threadStackKbByFunction.clear();
+        std::stringstream overrides(threadStackKbOverrides);
+        std::string item;
+        while (std::getline(overrides, item, ',')) {
+            size_t sep = item.rfind(':');
+            if (item.empty() || sep == std::string::npos) {
+                continue;
+            }
+
+            threadStackKbByFunction[item.substr(0, sep)] = std::stoi(item.substr(sep + 1));
+        }
+    }
+
+    bool FaasmConfig::useHugePages(const std::string &user, const std::string &function) {
+        return hugePages == "on" || hugePagesFunctionSet.count(user + "/" + function) > 0;
+    }
+
+    int FaasmConfig::getThreadStackKb(const std::string &user, const std::string &function) {
+        auto it = threadStackKbByFunction.find(user + "/" + function);
+        if (it != threadStackKbByFunction.end()) {
+            return it->second;
+        }
+
+        return threadStackKb;
+    }
+
+    void FaasmConfig::reset() {
+        this->initialise();
+    }
+
+    void FaasmConfig::print() {
+        const std::shared_ptr<spdlog::logger> &logger = getLogger();
+
+        logger->info("--- Faasm ---");
+        logger->info("ZYGOTE_RESET_MODE          {}", zygoteResetMode);
+        logger->info("ASYNC_MODULE_RESET         {}", asyncModuleReset);
+        logger->info("MODULE_CACHE_MAX_MB        {}", moduleCacheMaxMb);
+        logger->info("HOT_ZYGOTE_CALLS           {}", hotZygoteCalls);
+        logger->info("PRELOAD_DYNAMIC_MODULES    {}", preloadDynamicModules);
+        logger->info("OBJECT_CACHE_DIR           {}", objectCacheDir);
+        logger->info("CODEGEN_THREADS            {}", codegenThreads);
+        logger->info("TIERED_EXECUTION           {}", tieredExecution);
+        logger->info("MEMORY_RESERVE_PERCENT     {}", memoryReservePercent);
+        logger->info("HUGE_PAGES                 {}", hugePages);
+        logger->info("HUGE_PAGES_FUNCTIONS       {}", hugePagesFunctions);
+        logger->info("THREAD_MEMORY_MERGE        {}", threadMemoryMerge);
+        logger->info("THREAD_STACK_KB            {}", threadStackKb);
+        logger->info("THREAD_STACK_KB_OVERRIDES  {}", threadStackKbOverrides);
+        logger->info("THREAD_STACK_GUARD         {}", threadStackGuard);
+    }
+}
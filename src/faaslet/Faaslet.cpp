@@ -3,11 +3,14 @@
 #include <system/CGroup.h>
 #include <system/NetworkNamespace.h>
 
+#include <conf/FaasmConfig.h>
+#include <ir_cache/IRModuleCache.h>
 #include <faabric/scheduler/Scheduler.h>
 #include <faabric/util/config.h>
 #include <faabric/util/timing.h>
 #include <module_cache/WasmModuleCache.h>
 
+#include <wasm/serialisation.h>
 #include <wavm/WAVMWasmModule.h>
 
 #if(FAASM_SGX == 1)
@@ -41,8 +44,52 @@ namespace faaslet {
         module_cache::getWasmModuleCache().clear();
     }
 
+    /**
+     * Chained threads write the bytes they've changed since their snapshot to state,
+     * so the parent can merge them back in when it joins. The thread's own frames sit
+     * below the stack pointer recorded in its snapshot so are left out, but the parent's
+     * frames above it are included (e.g. a buffer on the parent's stack).
+     */
+    static void pushThreadMemoryDiff(wasm::WasmModule &module, const faabric::Message &call) {
+        const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+
+        module_cache::WasmModuleCache &registry = module_cache::getWasmModuleCache();
+        std::shared_ptr<wasm::WAVMWasmModule> cachedModule = registry.getCachedModule(call);
+
+        auto &wavmModule = dynamic_cast<wasm::WAVMWasmModule &>(module);
+        std::vector<uint8_t> diff = wavmModule.getMemoryDiff(*cachedModule, cachedModule->getStackPointer());
+
+        std::string diffKey = wasm::getThreadMemoryDiffKey(call.snapshotkey(), call.id());
+        logger->debug("Pushing {} byte memory diff for thread {}", diff.size(), call.id());
+
+        faabric::state::State &state = faabric::state::getGlobalState();
+        const std::shared_ptr<faabric::state::StateKeyValue> &kv = state.getKV(call.user(), diffKey, diff.size());
+        kv->set(diff.data());
+        kv->pushFull();
+    }
+
+    static void resetFromZygote(wasm::WasmModule &module, const faabric::Message &msg) {
+        const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+        const std::string funcStr = faabric::util::funcToString(msg, true);
+
+        module_cache::WasmModuleCache &registry = module_cache::getWasmModuleCache();
+        std::shared_ptr<wasm::WAVMWasmModule> cachedModule = registry.getCachedModule(msg);
+
+        auto &wavmModule = dynamic_cast<wasm::WAVMWasmModule &>(module);
+
+        // Only discard the dirty pages if possible, otherwise do a full clone
+        conf::FaasmConfig &faasmConf = conf::getFaasmConfig();
+        if (faasmConf.zygoteResetMode == "dirty" && wavmModule.resetDirtyPages(*cachedModule)) {
+            logger->debug("Reset dirty pages of module {} from zygote", funcStr);
+        } else {
+            logger->debug("Resetting module {} from zygote", funcStr);
+            wavmModule = *cachedModule;
+        }
+    }
+
     Faaslet::Faaslet(int threadIdxIn) : threadIdx(threadIdxIn),
-                                        scheduler(faabric::scheduler::getScheduler()) {
+                                        scheduler(faabric::scheduler::getScheduler()),
+                                        resetWorker(std::make_unique<ModuleResetWorker>()) {
         const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
 
         // Set an ID for this Faaslet
@@ -69,6 +116,8 @@ namespace faaslet {
     }
 
     void Faaslet::finish() {
+        awaitPendingReset();
+
         ns->removeCurrentThread();
 
         if (_isBound) {
@@ -77,6 +126,52 @@ namespace faaslet {
         }
     }
 
+    void Faaslet::awaitPendingReset() {
+        if (!pendingReset.valid()) {
+            return;
+        }
+
+        try {
+            pendingReset.get();
+        } catch (const std::exception &e) {
+            // Drop the spare, we'll fall back to resetting in place
+            const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+            logger->error("Failed to prepare spare module on {}: {}", id, e.what());
+            spareModule.reset();
+        }
+    }
+
+    void Faaslet::resetModule(const faabric::Message &msg) {
+        conf::FaasmConfig &faasmConf = conf::getFaasmConfig();
+        if (faasmConf.asyncModuleReset != "on") {
+            resetFromZygote(*module, msg);
+            return;
+        }
+
+        // Spare must be ready before we can swap it in
+        awaitPendingReset();
+
+        if (!spareModule) {
+            // No spare available, so reset in place and start preparing one
+            resetFromZygote(*module, msg);
+
+            pendingReset = resetWorker->submit([this, msg] {
+                module_cache::WasmModuleCache &registry = module_cache::getWasmModuleCache();
+                spareModule = std::make_unique<wasm::WAVMWasmModule>(*registry.getCachedModule(msg));
+            });
+            return;
+        }
+
+        // Swap in the clean spare and reset the used module in the background,
+        // so the next call doesn't have to wait for it
+        std::swap(module, spareModule);
+
+        wasm::WasmModule *usedModule = spareModule.get();
+        pendingReset = resetWorker->submit([usedModule, msg] {
+            resetFromZygote(*usedModule, msg);
+        });
+    }
+
     void Faaslet::finishCall(faabric::Message &call, bool success, const std::string &errorMsg) {
         const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
         const std::string funcStr = faabric::util::funcToString(call, true);
@@ -99,6 +194,13 @@ namespace faaslet {
 
         fflush(stdout);
 
+        // Ship back the chained thread's memory writes before anyone can join it
+        conf::FaasmConfig &faasmConf = conf::getFaasmConfig();
+        if (conf.wasmVm == "wavm" && !interpreted && faasmConf.threadMemoryMerge == "on" && call.funcptr() > 0 &&
+            call.ompnumthreads() == 0 && !call.snapshotkey().empty()) {
+            pushThreadMemoryDiff(*module, call);
+        }
+
         // Notify the scheduler *before* setting the result. Calls awaiting
         // the result will carry on blocking
         scheduler.notifyCallFinished(call);
@@ -107,20 +209,70 @@ namespace faaslet {
         logger->debug("Setting function result for {}", funcStr);
         scheduler.setFunctionResult(call);
 
-        if (conf.wasmVm == "wavm") {
-            // Restore from zygote
-            logger->debug("Resetting module {} from zygote", funcStr);
+        if (conf.wasmVm == "wavm" && interpreted) {
+            // Moves on to the compiled module if it's ready, otherwise starts afresh
+            bindToFunction(boundMessage, true);
+        } else if (conf.wasmVm == "wavm") {
             module_cache::WasmModuleCache &registry = module_cache::getWasmModuleCache();
-            wasm::WAVMWasmModule &cachedModule = registry.getCachedModule(call);
+            auto &wavmModule = dynamic_cast<wasm::WAVMWasmModule &>(*module);
 
-            auto *wavmModulePtr = dynamic_cast<wasm::WAVMWasmModule *>(module.get());
-            *wavmModulePtr = cachedModule;
+            // Have the zygote load any libraries this call opened
+            if (success && faasmConf.preloadDynamicModules == "on" && call.funcptr() == 0) {
+                registry.recordDynamicModules(call, wavmModule);
+            }
+
+            // Warm up the zygote from this module if it's done enough calls
+            if (success && faasmConf.hotZygoteCalls > 0 && call.funcptr() == 0) {
+                registry.recordSuccessfulCall(call, wavmModule);
+            }
+
+            resetModule(call);
         }
 
         // Increment the execution counter
         executionCount++;
     }
 
+    /**
+     * With tiered execution, functions whose WAVM code isn't ready yet are run in WAMR's
+     * interpreter while it's compiled in the background, rather than blocking the first
+     * calls on codegen. Snapshots and threading need WAVM so aren't interpreted, nor are
+     * functions importing anything WAMR doesn't provide.
+     *
+     * Returns the bound interpreted module, or null if the function should wait for WAVM.
+     */
+    static std::unique_ptr<wasm::WasmModule> bindInterpretedTier(const faabric::Message &msg) {
+#if(FAASM_SGX == 1)
+        return nullptr;
+#else
+        conf::FaasmConfig &faasmConf = conf::getFaasmConfig();
+        if (faasmConf.tieredExecution != "on" || !msg.snapshotkey().empty() || msg.ispython()) {
+            return nullptr;
+        }
+
+        wasm::IRModuleCache &irCache = wasm::getIRModuleCache();
+        if (irCache.prepareCompiledMainModule(msg.user(), msg.function())) {
+            return nullptr;
+        }
+
+        auto wamrModule = std::make_unique<wasm::WAMRWasmModule>();
+        wamrModule->bindToFunctionInterpreted(msg);
+        if (!wamrModule->allImportsResolved()) {
+            faabric::util::getLogger()->debug("Not interpreting {}, waiting for codegen",
+                                             faabric::util::funcToString(msg, false));
+            return nullptr;
+        }
+
+        faabric::util::getLogger()->debug("Interpreting {} until codegen finishes",
+                                         faabric::util::funcToString(msg, false));
+        return wamrModule;
+#endif
+    }
+
+    bool Faaslet::isInterpreted() {
+        return interpreted;
+    }
+
     void Faaslet::bindToFunction(const faabric::Message &msg, bool force) {
         // If already bound, will be an error, unless forced to rebind to the same message
         if (_isBound) {
@@ -133,6 +285,10 @@ namespace faaslet {
             }
         }
 
+        // Any spare belongs to the old binding
+        awaitPendingReset();
+        spareModule.reset();
+
         boundMessage = msg;
 
         // Get queue from the scheduler
@@ -149,15 +305,28 @@ namespace faaslet {
             module = std::make_unique<wasm::WAMRWasmModule>();
 #endif
             module->bindToFunction(msg);
+        } else if (std::unique_ptr<wasm::WasmModule> interpretedModule = bindInterpretedTier(msg)) {
+            module = std::move(interpretedModule);
+            interpreted = true;
         } else {
+            interpreted = false;
+
             // Instantiate a WAVM module from its snapshot
             PROF_START(snapshotRestore)
 
             module_cache::WasmModuleCache &registry = module_cache::getWasmModuleCache();
-            wasm::WAVMWasmModule &snapshot = registry.getCachedModule(msg);
-            module = std::make_unique<wasm::WAVMWasmModule>(snapshot);
+            std::shared_ptr<wasm::WAVMWasmModule> snapshot = registry.getCachedModule(msg);
+            module = std::make_unique<wasm::WAVMWasmModule>(*snapshot);
 
             PROF_END(snapshotRestore)
+
+            // Prepare the spare in the background
+            conf::FaasmConfig &faasmConf = conf::getFaasmConfig();
+            if (faasmConf.asyncModuleReset == "on") {
+                pendingReset = resetWorker->submit([this, snapshot] {
+                    spareModule = std::make_unique<wasm::WAVMWasmModule>(*snapshot);
+                });
+            }
         }
 
         _isBound = true;
@@ -205,7 +374,9 @@ namespace faaslet {
         // Handle the message
         std::string errorMessage;
         if (msg.isflushrequest()) {
-            // Clear out this worker host if we've received a flush message
+            // Clear out this worker host if we've received a flush message. Any
+            // background reset may still be using the module cache.
+            awaitPendingReset();
             flushFaasletHost();
 
             scheduler.preflightPythonCall();
@@ -239,8 +410,9 @@ namespace faaslet {
                     PROF_START(snapshotOverride)
 
                     module_cache::WasmModuleCache &registry = module_cache::getWasmModuleCache();
-                    wasm::WAVMWasmModule &snapshot = registry.getCachedModule(msg);
-                    module = std::make_unique<wasm::WAVMWasmModule>(snapshot);
+                    std::shared_ptr<wasm::WAVMWasmModule> snapshot = registry.getCachedModule(msg);
+                    module = std::make_unique<wasm::WAVMWasmModule>(*snapshot);
+                    interpreted = false;
 
                     PROF_END(snapshotOverride)
                 }
@@ -1,5 +1,6 @@
 #include "FaasmMain.h"
 
+#include <conf/FaasmConfig.h>
 #include <faabric/util/config.h>
 #include <faabric/util/logging.h>
 #include <module_cache/WasmModuleCache.h>
@@ -15,6 +16,7 @@ namespace faaslet {
         scheduler.addHostToGlobalSet();
 
         conf.print();
+        conf::getFaasmConfig().print();
 
         // Start thread pool in background
         pool.startThreadPool();
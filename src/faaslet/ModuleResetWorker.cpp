@@ -0,0 +1,62 @@
+#include "ModuleResetWorker.h"
+
+#include <faabric/util/locks.h>
+
+namespace faaslet {
+    /**
+     * Anything already submitted is run before the thread exits, as callers may be
+     * waiting on it.
+     */
+    ModuleResetWorker::~ModuleResetWorker() {
+        {
+            faabric::util::UniqueLock lock(mx);
+            stopping = true;
+        }
+
+        cv.notify_one();
+
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    std::future<void> ModuleResetWorker::submit(std::function<void()> task) {
+        std::packaged_task<void()> packagedTask(std::move(task));
+        std::future<void> future = packagedTask.get_future();
+
+        {
+            faabric::util::UniqueLock lock(mx);
+            tasks.emplace_back(std::move(packagedTask));
+
+            if (!thread.joinable()) {
+                thread = std::thread(&ModuleResetWorker::run, this);
+            }
+        }
+
+        cv.notify_one();
+
+        return future;
+    }
+
+    void ModuleResetWorker::run() {
+        while (true) {
+            std::packaged_task<void()> task;
+            {
+                faabric::util::UniqueLock lock(mx);
+                cv.wait(lock, [this] {
+                    return stopping || !tasks.empty();
+                });
+
+                if (tasks.empty()) {
+                    return;
+                }
+
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+
+            // Exceptions end up in the task's future
+            task();
+        }
+    }
+}
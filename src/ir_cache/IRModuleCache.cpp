@@ -1,4 +1,5 @@
 #include "IRModuleCache.h"
+#include "ObjectCache.h"
 
 #include <faabric/util/locks.h>
 #include <faabric/util/logging.h>
@@ -12,19 +13,36 @@
 #include <faabric/util/func.h>
 #include <faabric/util/files.h>
 
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <chrono>
+#include <future>
+
 
 namespace wasm {
     IRModuleCache::IRModuleCache() : conf(faabric::util::getSystemConfig()) {
 
     }
 
+    IRModuleCache::~IRModuleCache() {
+        awaitBackgroundCompiles();
+    }
+
     IRModuleCache &getIRModuleCache() {
         static IRModuleCache r;
         return r;
     }
 
+    /**
+     * Shared modules don't depend on the main module importing them, so are keyed on their
+     * path alone and one copy serves every function that loads them.
+     */
     std::string getModuleKey(const std::string &user, const std::string &func, const std::string &path) {
-        std::string key = user + "_" + func + "_" + path;
+        if (!path.empty()) {
+            return "shared_" + path;
+        }
+
+        std::string key = user + "_" + func + "_";
         return key;
     }
 
@@ -39,16 +57,6 @@ namespace wasm {
     }
 
     IR::Module &IRModuleCache::getModule(const std::string &user, const std::string &func, const std::string &path) {
-        /*
-         * Note that shared modules are currently only shared in memory across instances of the *same* function.
-         * If two different functions both load shared module A, it will be loaded into memory twice.
-         *
-         * This is currently only to do with needing to modify the table definition to fit with the importing main
-         * module, something which can probably be fixed.
-         *
-         * TODO - implement this proper sharing of modules
-         */
-
         if (path.empty()) {
             return this->getMainModule(user, func);
         } else {
@@ -68,35 +76,211 @@ namespace wasm {
     U64 IRModuleCache::getSharedModuleTableSize(const std::string &user, const std::string &func,
                                                    const std::string &path) {
         const std::string key = getModuleKey(user, func, path);
-        return originalTableSizes[key];
+        faabric::util::SharedLock lock(registryMutex);
+        auto it = originalTableSizes.find(key);
+        if (it == originalTableSizes.end()) {
+            return 0;
+        }
+
+        return it->second;
+    }
+
+    /**
+     * Returns the value for the given key, loading it if not already present. Only the
+     * first caller for a key does the load, and does so without holding the registry lock,
+     * so loads of different keys run concurrently. Other callers for the same key wait on
+     * the first caller's result.
+     *
+     * If the load fails, everyone waiting gets the error and the key is removed so that it
+     * can be retried.
+     */
+    template<typename T, typename F>
+    static T getOrLoad(std::shared_mutex &mx, std::unordered_map<std::string, std::shared_future<T>> &map,
+                       const std::string &key, F load) {
+        std::shared_future<T> future;
+        {
+            faabric::util::SharedLock lock(mx);
+            auto it = map.find(key);
+            if (it != map.end()) {
+                future = it->second;
+            }
+        }
+
+        if (future.valid()) {
+            return future.get();
+        }
+
+        std::promise<T> promise;
+        {
+            faabric::util::FullLock lock(mx);
+            auto it = map.find(key);
+            if (it != map.end()) {
+                future = it->second;
+            } else {
+                map[key] = promise.get_future().share();
+            }
+        }
+
+        if (future.valid()) {
+            return future.get();
+        }
+
+        try {
+            T result = load();
+            promise.set_value(result);
+            return result;
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+
+            faabric::util::FullLock lock(mx);
+            map.erase(key);
+            throw;
+        }
+    }
+
+    void IRModuleCache::setObjectCacheKey(const std::string &key, const std::vector<uint8_t> &wasmBytes) {
+        if (!getObjectCache().isEnabled()) {
+            return;
+        }
+
+        std::string objectKey = getObjectCacheKey(wasmBytes);
+
+        faabric::util::FullLock lock(registryMutex);
+        objectCacheKeys[key] = objectKey;
+    }
+
+    /**
+     * Loads the module's object code from the object cache if it's there, otherwise
+     * loads it as normal and adds it to the object cache for next time.
+     */
+    Runtime::ModuleRef IRModuleCache::loadCompiledModule(const std::string &key, IR::Module &module,
+                                                         const std::function<Runtime::ModuleRef()> &loadUncached) {
+        const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+
+        ObjectCache &objectCache = getObjectCache();
+        if (!objectCache.isEnabled()) {
+            return loadUncached();
+        }
+
+        std::string objectKey;
+        {
+            faabric::util::SharedLock lock(registryMutex);
+            auto it = objectCacheKeys.find(key);
+            if (it != objectCacheKeys.end()) {
+                objectKey = it->second;
+            }
+        }
+
+        if (objectKey.empty()) {
+            return loadUncached();
+        }
+
+        std::shared_ptr<MappedObjectFile> cachedObject = objectCache.load(objectKey);
+        if (cachedObject) {
+            logger->debug("Loading {} from object cache ({})", key, objectKey);
+
+            // WAVM only takes object code as a vector, so this is the one copy we make
+            std::vector<U8> objectBytes(cachedObject->data(), cachedObject->data() + cachedObject->size());
+            return Runtime::loadPrecompiledModule(module, objectBytes);
+        }
+
+        Runtime::ModuleRef compiledModule = loadUncached();
+
+        try {
+            objectCache.store(objectKey, Runtime::getObjectCode(compiledModule));
+        } catch (std::runtime_error &e) {
+            logger->warn("Failed to add {} to object cache: {}", key, e.what());
+        }
+
+        return compiledModule;
     }
 
     Runtime::ModuleRef IRModuleCache::getCompiledMainModule(const std::string &user, const std::string &func) {
         const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
         const std::string key = getModuleKey(user, func, "");
 
-        if (getCompiledModuleCount(key) == 0) {
-            faabric::util::FullLock registryLock(registryMutex);
-            if (compiledModuleMap.count(key) == 0) {
-                IR::Module &module = moduleMap[key];
-                module.featureSpec.simd = true;
-                module.featureSpec.atomics = true;
+        return getOrLoad(registryMutex, compiledModuleMap, key, [this, &logger, &key, &user, &func] {
+            logger->debug("Loading compiled main module {}", key);
+
+            IR::Module &module = getMainModule(user, func);
 
+            return loadCompiledModule(key, module, [&module, &user, &func] {
                 storage::FileLoader &functionLoader = storage::getFileLoader();
                 faabric::Message msg = faabric::util::messageFactory(user, func);
                 std::vector<uint8_t> objectFileBytes = functionLoader.loadFunctionObjectFile(msg);
 
                 if (!objectFileBytes.empty()) {
-                    compiledModuleMap[key] = Runtime::loadPrecompiledModule(module, objectFileBytes);
+                    return Runtime::loadPrecompiledModule(module, objectFileBytes);
                 } else {
-                    compiledModuleMap[key] = Runtime::compileModule(module);
+                    return Runtime::compileModule(module);
                 }
+            });
+        });
+    }
+
+    /**
+     * Used for tiered execution. Returns true if the compiled main module can be had
+     * without a full compile, i.e. it's already loaded or there's object code to load.
+     * Otherwise kicks off the compile in the background and returns false, so the
+     * caller can run something cheaper in the meantime.
+     */
+    bool IRModuleCache::prepareCompiledMainModule(const std::string &user, const std::string &func) {
+        const std::string key = getModuleKey(user, func, "");
+
+        {
+            faabric::util::SharedLock lock(registryMutex);
+            auto it = compiledModuleMap.find(key);
+            if (it != compiledModuleMap.end()) {
+                return it->second.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
             }
-        } else {
-            logger->debug("Using cached compiled main module {}", key);
         }
 
-        return compiledModuleMap[key];
+        faabric::Message msg = faabric::util::messageFactory(user, func);
+        if (boost::filesystem::exists(faabric::util::getFunctionObjectFile(msg))) {
+            return true;
+        }
+
+        // Concurrent callers all end up waiting on the same load
+        faabric::util::UniqueLock lock(backgroundMutex);
+        backgroundCompiles.erase(
+                std::remove_if(backgroundCompiles.begin(), backgroundCompiles.end(), [](std::future<void> &f) {
+                    return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+                }),
+                backgroundCompiles.end()
+        );
+
+        backgroundCompiles.emplace_back(std::async(std::launch::async, [this, user, func] {
+            try {
+                getCompiledMainModule(user, func);
+            } catch (std::exception &e) {
+                faabric::util::getLogger()->error("Background compile of {}/{} failed: {}", user, func, e.what());
+            }
+        }));
+
+        return false;
+    }
+
+    void IRModuleCache::awaitBackgroundCompiles() {
+        std::vector<std::future<void>> compiles;
+        {
+            faabric::util::UniqueLock lock(backgroundMutex);
+            compiles.swap(backgroundCompiles);
+        }
+
+        for (auto &f : compiles) {
+            f.wait();
+        }
+    }
+
+    /**
+     * Drops all compiled modules, once any background compiles have finished. IR modules
+     * are kept, as instantiated modules may still refer to them.
+     */
+    void IRModuleCache::clear() {
+        awaitBackgroundCompiles();
+
+        faabric::util::FullLock lock(registryMutex);
+        compiledModuleMap.clear();
     }
 
     Runtime::ModuleRef IRModuleCache::getCompiledSharedModule(const std::string &user, const std::string &func,
@@ -104,67 +288,54 @@ namespace wasm {
         std::string key = getModuleKey(user, func, path);
         const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
 
-        if (getCompiledModuleCount(key) == 0) {
-            faabric::util::FullLock registryLock(registryMutex);
-            if (compiledModuleMap.count(key) == 0) {
-                logger->debug("Loading compiled shared module {}", key);
+        return getOrLoad(registryMutex, compiledModuleMap, key, [this, &logger, &key, &user, &func, &path] {
+            logger->debug("Loading compiled shared module {}", key);
 
-                IR::Module &module = moduleMap[key];
-                module.featureSpec.simd = true;
-                module.featureSpec.atomics = true;
+            IR::Module &module = getSharedModule(user, func, path);
 
+            return loadCompiledModule(key, module, [&module, &path] {
                 storage::FileLoader &functionLoader = storage::getFileLoader();
                 std::vector<uint8_t> objectBytes = functionLoader.loadSharedObjectObjectFile(path);
-                compiledModuleMap[key] = Runtime::loadPrecompiledModule(module, objectBytes);
-            }
-        } else {
-            logger->debug("Using cached shared compiled module {}", key);
-        }
-
-        return compiledModuleMap[key];
+                return Runtime::loadPrecompiledModule(module, objectBytes);
+            });
+        });
     }
 
     IR::Module &IRModuleCache::getMainModule(const std::string &user, const std::string &func) {
         const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
         const std::string key = getModuleKey(user, func, "");
 
-        // Check if initialised
-        if (getModuleCount(key) == 0) {
-            faabric::util::FullLock registryLock(registryMutex);
-            if (moduleMap.count(key) == 0) {
-                logger->debug("Loading main module {}", key);
+        return *getOrLoad(registryMutex, moduleMap, key, [this, &logger, &key, &user, &func] {
+            logger->debug("Loading main module {}", key);
 
-                storage::FileLoader &functionLoader = storage::getFileLoader();
+            storage::FileLoader &functionLoader = storage::getFileLoader();
 
-                faabric::Message msg = faabric::util::messageFactory(user, func);
-                std::vector<uint8_t> wasmBytes = functionLoader.loadFunctionWasm(msg);
+            faabric::Message msg = faabric::util::messageFactory(user, func);
+            std::vector<uint8_t> wasmBytes = functionLoader.loadFunctionWasm(msg);
+            setObjectCacheKey(key, wasmBytes);
 
-                IR::Module &module = moduleMap[key];
-                module.featureSpec.simd = true;
-                module.featureSpec.atomics = true;
+            auto module = std::make_shared<IR::Module>();
+            setCodegenFeatures(module->featureSpec);
 
-                if (faabric::util::isWasm(wasmBytes)) {
-                    WASM::LoadError loadError;
-                    WASM::loadBinaryModule(wasmBytes.data(), wasmBytes.size(), module, &loadError);
-                } else {
-                    std::vector<WAST::Error> parseErrors;
-                    WAST::parseModule((const char *) wasmBytes.data(), wasmBytes.size(), module, parseErrors);
-                    WAST::reportParseErrors("wast_file", (const char *) wasmBytes.data(), parseErrors);
-                }
+            if (faabric::util::isWasm(wasmBytes)) {
+                WASM::LoadError loadError;
+                WASM::loadBinaryModule(wasmBytes.data(), wasmBytes.size(), *module, &loadError);
+            } else {
+                std::vector<WAST::Error> parseErrors;
+                WAST::parseModule((const char *) wasmBytes.data(), wasmBytes.size(), *module, parseErrors);
+                WAST::reportParseErrors("wast_file", (const char *) wasmBytes.data(), parseErrors);
+            }
 
-                // Force maximum size
-                module.memories.defs[0].type.size.max = (U64) MAX_MEMORY_PAGES;
+            // Force maximum size
+            module->memories.defs[0].type.size.max = (U64) MAX_MEMORY_PAGES;
 
-                // Typescript modules don't seem to define a table
-                if(!module.tables.defs.empty()) {
-                    module.tables.defs[0].type.size.max = (U64) MAX_TABLE_SIZE;
-                }
+            // Typescript modules don't seem to define a table
+            if(!module->tables.defs.empty()) {
+                module->tables.defs[0].type.size.max = (U64) MAX_TABLE_SIZE;
             }
-        } else {
-            logger->debug("Using cached main module {}", key);
-        }
 
-        return moduleMap[key];
+            return module;
+        });
     }
 
     IR::Module &IRModuleCache::getSharedModule(const std::string &user, const std::string &func,
@@ -172,47 +343,43 @@ namespace wasm {
         std::string key = getModuleKey(user, func, path);
         const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
 
-        // Check if initialised
-        if (getModuleCount(key) == 0) {
-            faabric::util::FullLock lock(registryMutex);
-            if (moduleMap.count(key) == 0) {
-                logger->debug("Loading shared module {}", key);
+        return *getOrLoad(registryMutex, moduleMap, key, [this, &logger, &key, &path] {
+            logger->debug("Loading shared module {}", key);
 
-                storage::FileLoader &functionLoader = storage::getFileLoader();
+            storage::FileLoader &functionLoader = storage::getFileLoader();
 
-                std::vector<uint8_t> wasmBytes = functionLoader.loadSharedObjectWasm(path);
+            std::vector<uint8_t> wasmBytes = functionLoader.loadSharedObjectWasm(path);
+            setObjectCacheKey(key, wasmBytes);
 
-                IR::Module &module = moduleMap[key];
-                module.featureSpec.simd = true;
-                module.featureSpec.atomics = true;
+            auto module = std::make_shared<IR::Module>();
+            setCodegenFeatures(module->featureSpec);
 
-                WASM::LoadError loadError;
-                WASM::loadBinaryModule(wasmBytes.data(), wasmBytes.size(), module, &loadError);
+            WASM::LoadError loadError;
+            WASM::loadBinaryModule(wasmBytes.data(), wasmBytes.size(), *module, &loadError);
 
-                // Check that the module isn't expecting to create any memories or tables
-                if (!module.tables.defs.empty()) {
-                    throw std::runtime_error("Dynamic module trying to define tables");
-                }
-
-                if (!module.memories.defs.empty()) {
-                    throw std::runtime_error("Dynamic module trying to define memories");
-                }
+            // Check that the module isn't expecting to create any memories or tables
+            if (!module->tables.defs.empty()) {
+                throw std::runtime_error("Dynamic module trying to define tables");
+            }
 
-                // TODO - better way to handle this? Modify WAVM?
-                // To keep WAVM happy, we have to force the incoming dynamic module to accept the table from the
-                // main module. This modifies the shared reference, therefore we also have to preserve the original
-                // size and make available to callers.
-                this->originalTableSizes[key] = module.tables.imports[0].type.size.min;
+            if (!module->memories.defs.empty()) {
+                throw std::runtime_error("Dynamic module trying to define memories");
+            }
 
-                const std::string mainKey = getModuleKey(user, func, "");
-                IR::Module &mainModule = moduleMap[mainKey];
-                module.tables.imports[0].type.size.min = (U64) mainModule.tables.defs[0].type.size.min;
-                module.tables.imports[0].type.size.max = (U64) mainModule.tables.defs[0].type.size.max;
+            // WAVM only links the dynamic module against a table that fits its declared import
+            // limits, so we open them right up to accept any main module's table. The table
+            // size isn't baked into the object code, and the module's own entries are placed
+            // at the table base it's given at link time. The original size is how much the
+            // table needs to grow by to fit the module, so is kept for callers.
+            {
+                faabric::util::FullLock lock(registryMutex);
+                this->originalTableSizes[key] = module->tables.imports[0].type.size.min;
             }
-        } else {
-            logger->debug("Loading cached shared module {}", key);
-        }
 
-        return moduleMap[key];
+            module->tables.imports[0].type.size.min = 0;
+            module->tables.imports[0].type.size.max = UINT64_MAX;
+
+            return module;
+        });
     }
-}
\ No newline at end of file
+}
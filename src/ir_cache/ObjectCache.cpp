@@ -0,0 +1,178 @@
+#include "ObjectCache.h"
+
+#include <conf/FaasmConfig.h>
+#include <faabric/util/logging.h>
+
+#include <boost/filesystem.hpp>
+#include <openssl/evp.h>
+
+#include <WAVM/LLVMJIT/LLVMJIT.h>
+
+#include <fcntl.h>
+#include <stdexcept>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace wasm {
+    ObjectCache &getObjectCache() {
+        static ObjectCache c(conf::getFaasmConfig().objectCacheDir);
+        return c;
+    }
+
+    /**
+     * Features enabled on every module before it's loaded, and so compiled with
+     */
+    void setCodegenFeatures(WAVM::IR::FeatureSpec &featureSpec) {
+        featureSpec.simd = true;
+        featureSpec.atomics = true;
+    }
+
+    /**
+     * Everything other than the wasm which affects the generated code, i.e. the builds of
+     * WAVM and LLVM, the features modules are loaded with and the target compiled for
+     */
+    static std::string getCodegenOptions() {
+        WAVM::IR::FeatureSpec featureSpec;
+        setCodegenFeatures(featureSpec);
+
+        WAVM::LLVMJIT::TargetSpec targetSpec = WAVM::LLVMJIT::getHostTargetSpec();
+
+        return std::string("wavm-") + FAASM_WAVM_VERSION + ";llvm-" + FAASM_LLVM_VERSION +
+               ";simd=" + std::to_string(featureSpec.simd) +
+               ";atomics=" + std::to_string(featureSpec.atomics) +
+               ";" + targetSpec.triple + ";" + targetSpec.cpu +
+               ";v" + std::to_string(OBJECT_CACHE_VERSION);
+    }
+
+    /**
+     * Hex SHA-256 of the codegen options followed by the wasm bytes
+     */
+    std::string getObjectCacheKey(const std::vector<uint8_t> &wasmBytes) {
+        static const std::string options = getCodegenOptions();
+
+        EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digestLen = 0;
+
+        bool success = ctx != nullptr &&
+                       EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) == 1 &&
+                       EVP_DigestUpdate(ctx, options.data(), options.size()) == 1 &&
+                       EVP_DigestUpdate(ctx, wasmBytes.data(), wasmBytes.size()) == 1 &&
+                       EVP_DigestFinal_ex(ctx, digest, &digestLen) == 1;
+        EVP_MD_CTX_free(ctx);
+
+        if (!success) {
+            throw std::runtime_error("Failed to hash wasm for object cache");
+        }
+
+        static const char *hexChars = "0123456789abcdef";
+        std::string key;
+        key.reserve(2 * digestLen);
+        for (unsigned int i = 0; i < digestLen; i++) {
+            key += hexChars[digest[i] >> 4];
+            key += hexChars[digest[i] & 0xf];
+        }
+
+        return key;
+    }
+
+    MappedObjectFile::MappedObjectFile(const uint8_t *data, size_t size) : _data(data), _size(size) {
+
+    }
+
+    MappedObjectFile::~MappedObjectFile() {
+        munmap((void *) _data, _size);
+    }
+
+    const uint8_t *MappedObjectFile::data() const {
+        return _data;
+    }
+
+    size_t MappedObjectFile::size() const {
+        return _size;
+    }
+
+    ObjectCache::ObjectCache(const std::string &dirIn) : dir(dirIn) {
+
+    }
+
+    bool ObjectCache::isEnabled() {
+        return !dir.empty();
+    }
+
+    std::string ObjectCache::getObjectPath(const std::string &key) {
+        return dir + "/" + key + ".o";
+    }
+
+    /**
+     * Returns null if the object isn't in the cache
+     */
+    std::shared_ptr<MappedObjectFile> ObjectCache::load(const std::string &key) {
+        const std::string path = getObjectPath(key);
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return nullptr;
+        }
+
+        struct stat st{};
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return nullptr;
+        }
+
+        // Mapping stays valid once the fd is closed
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (data == MAP_FAILED) {
+            faabric::util::getLogger()->error("Failed to map cached object {} ({} - {})", path, errno,
+                                              strerror(errno));
+            return nullptr;
+        }
+
+        return std::make_shared<MappedObjectFile>((const uint8_t *) data, (size_t) st.st_size);
+    }
+
+    void ObjectCache::store(const std::string &key, const std::vector<uint8_t> &objBytes) {
+        const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+
+        boost::filesystem::create_directories(dir);
+
+        // Write to a file only this thread uses, then move into place
+        const std::string path = getObjectPath(key);
+        std::string tmpPath = path + ".tmp." + std::to_string(getpid()) + "." +
+                              std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+
+        int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            logger->error("Failed to open {} ({} - {})", tmpPath, errno, strerror(errno));
+            throw std::runtime_error("Failed to write to object cache");
+        }
+
+        size_t offset = 0;
+        while (offset < objBytes.size()) {
+            ssize_t written = write(fd, objBytes.data() + offset, objBytes.size() - offset);
+            if (written <= 0) {
+                close(fd);
+                unlink(tmpPath.c_str());
+                logger->error("Failed to write {} ({} - {})", tmpPath, errno, strerror(errno));
+                throw std::runtime_error("Failed to write to object cache");
+            }
+
+            offset += written;
+        }
+
+        close(fd);
+
+        if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+            unlink(tmpPath.c_str());
+            logger->error("Failed to move {} into object cache ({} - {})", tmpPath, errno, strerror(errno));
+            throw std::runtime_error("Failed to write to object cache");
+        }
+
+        logger->debug("Stored {} byte object in cache at {}", objBytes.size(), path);
+    }
+}
@@ -1,9 +1,19 @@
 #include "WasmModuleCache.h"
 
+#include <conf/FaasmConfig.h>
 #include <faabric/util/locks.h>
 #include <faabric/util/func.h>
 #include <faabric/util/config.h>
+#include <faabric/util/memory.h>
+#include <faabric/util/timing.h>
+#include <algorithm>
+#include <cstring>
 #include <sys/mman.h>
+#include <unistd.h>
+
+#include <WAVM/Runtime/Runtime.h>
+
+using namespace WAVM;
 
 namespace module_cache {
     WasmModuleCache &getWasmModuleCache() {
@@ -11,14 +21,59 @@ namespace module_cache {
         return r;
     }
 
+    /**
+     * Zygotes own the memfd backing their copy-on-write memory, so it's closed once the
+     * last reference to the zygote goes (i.e. once it's been evicted and nobody is still
+     * cloning from it). Existing clones keep their mappings of the fd alive.
+     */
+    static std::shared_ptr<wasm::WAVMWasmModule> newZygote(int fd) {
+        return std::shared_ptr<wasm::WAVMWasmModule>(
+                new wasm::WAVMWasmModule(),
+                [fd](wasm::WAVMWasmModule *module) {
+                    delete module;
+                    close(fd);
+                }
+        );
+    }
+
+    static int createZygoteFd(const std::string &key) {
+        int fd = memfd_create(key.c_str(), 0);
+        if (fd == -1) {
+            faabric::util::getLogger()->error("Failed to create memfd for zygote {} ({} - {})", key, errno,
+                                              strerror(errno));
+            throw std::runtime_error("Failed to create zygote memfd");
+        }
+
+        return fd;
+    }
+
     size_t WasmModuleCache::getTotalCachedModuleCount() {
+        faabric::util::SharedLock lock(mx);
         return cachedModuleMap.size();
     }
 
-    int WasmModuleCache::getCachedModuleCount(const std::string &key) {
+    size_t WasmModuleCache::getTotalCachedBytes() {
+        faabric::util::SharedLock lock(mx);
+        return totalCachedBytes;
+    }
+
+    bool WasmModuleCache::isCached(const faabric::Message &msg) {
         faabric::util::SharedLock lock(mx);
-        int count = cachedModuleMap.count(key);
-        return count;
+        return cachedModuleMap.count(getCachedModuleKey(msg)) > 0;
+    }
+
+    CachedModuleUsage WasmModuleCache::getCachedModuleUsage(const faabric::Message &msg) {
+        faabric::util::SharedLock lock(mx);
+
+        CachedModuleUsage usage;
+        auto it = cachedModuleMap.find(getCachedModuleKey(msg));
+        if (it != cachedModuleMap.end()) {
+            usage = it->second.usage;
+            usage.hits = it->second.hits;
+            usage.hot = it->second.hot;
+        }
+
+        return usage;
     }
 
     std::string WasmModuleCache::getBaseCachedModuleKey(const faabric::Message &msg) {
@@ -35,64 +90,390 @@ namespace module_cache {
         }
     }
 
+    std::shared_ptr<wasm::WAVMWasmModule> WasmModuleCache::getCachedModuleIfExists(const std::string &key) {
+        faabric::util::SharedLock lock(mx);
+
+        auto it = cachedModuleMap.find(key);
+        if (it == cachedModuleMap.end()) {
+            return nullptr;
+        }
+
+        it->second.lastUsed = ++useCounter;
+        it->second.hits++;
+
+        return it->second.module;
+    }
+
+    /**
+     * Must be called with the full lock held
+     */
+    std::shared_ptr<wasm::WAVMWasmModule> WasmModuleCache::addCachedModule(
+            const std::string &key,
+            const std::shared_ptr<wasm::WAVMWasmModule> &module
+    ) {
+        CachedModuleEntry &entry = cachedModuleMap[key];
+        entry.module = module;
+        entry.lastUsed = ++useCounter;
+        entry.hits = 1;
+
+        // Count what's actually allocated rather than the virtual sizes, as most of
+        // memory is usually untouched zeroes
+        entry.usage.memoryBytes = module->getPrivateMemoryBytes();
+        entry.usage.fdBytes = module->getMemoryFdAllocatedBytes();
+
+        totalCachedBytes += entry.usage.memoryBytes + entry.usage.fdBytes;
+
+        return module;
+    }
+
+    /**
+     * Must be called with the full lock held. Evicts the least recently used entries
+     * until the cache is back under budget. One-off snapshots (e.g. those made when
+     * spawning threads) are only used once, so will be the first to go.
+     *
+     * Evicted modules are returned so the caller can drop them once the lock is
+     * released, as tearing down a zygote isn't free.
+     */
+    std::vector<std::shared_ptr<wasm::WAVMWasmModule>> WasmModuleCache::evictIfNeeded(const std::string &keepKey) {
+        std::vector<std::shared_ptr<wasm::WAVMWasmModule>> evicted;
+
+        conf::FaasmConfig &conf = conf::getFaasmConfig();
+        if (conf.moduleCacheMaxMb <= 0) {
+            return evicted;
+        }
+
+        size_t maxBytes = ((size_t) conf.moduleCacheMaxMb) * 1024L * 1024L;
+        const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+
+        while (totalCachedBytes > maxBytes) {
+            auto victim = cachedModuleMap.end();
+            for (auto it = cachedModuleMap.begin(); it != cachedModuleMap.end(); ++it) {
+                if (it->first == keepKey) {
+                    continue;
+                }
+
+                if (victim == cachedModuleMap.end() || it->second.lastUsed < victim->second.lastUsed) {
+                    victim = it;
+                }
+            }
+
+            // Nothing left we're allowed to evict
+            if (victim == cachedModuleMap.end()) {
+                break;
+            }
+
+            size_t victimBytes = victim->second.usage.memoryBytes + victim->second.usage.fdBytes;
+            logger->debug("Evicting zygote {} ({} bytes, {} hits)", victim->first, victimBytes,
+                          victim->second.hits);
+
+            totalCachedBytes -= victimBytes;
+            evicted.emplace_back(std::move(victim->second.module));
+            cachedModuleMap.erase(victim);
+        }
+
+        return evicted;
+    }
+
+    /**
+     * Much of a function's expensive initialisation (e.g. imports, static tables) only
+     * happens on its first real call. If configured, once a function has completed
+     * enough successful calls we replace its base zygote with a copy of the warmed-up
+     * module, so that later cold starts and resets don't have to repeat that work.
+     *
+     * Only one caller captures the hot zygote. Existing clones of the old zygote keep
+     * its memory alive, and will be fully re-cloned on their next reset.
+     *
+     * Returns true if the zygote was replaced.
+     */
+    bool WasmModuleCache::recordSuccessfulCall(const faabric::Message &msg,
+                                               const wasm::WAVMWasmModule &module) {
+        conf::FaasmConfig &conf = conf::getFaasmConfig();
+        if (conf.hotZygoteCalls <= 0 || !msg.snapshotkey().empty()) {
+            return false;
+        }
+
+        // Holding on to the old zygote keeps the fd the module was cloned from open
+        const std::string key = getBaseCachedModuleKey(msg);
+        std::shared_ptr<wasm::WAVMWasmModule> oldZygote;
+        {
+            faabric::util::SharedLock lock(mx);
+            auto it = cachedModuleMap.find(key);
+            if (it == cachedModuleMap.end() || it->second.hot) {
+                return false;
+            }
+
+            if (++it->second.successfulCalls != (uint64_t) conf.hotZygoteCalls) {
+                return false;
+            }
+
+            oldZygote = it->second.module;
+        }
+
+        const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+        logger->debug("Capturing hot zygote for {} after {} calls", key, conf.hotZygoteCalls);
+
+        PROF_START(hotZygoteCapture)
+
+        // Cloning maps memory from the old zygote's fd, so copy over the warmed pages
+        int fd = createZygoteFd(key);
+        std::shared_ptr<wasm::WAVMWasmModule> hotZygote = newZygote(fd);
+        *hotZygote = module;
+
+        U8 *hotBase = Runtime::getMemoryBaseAddress(hotZygote->defaultMemory);
+        U8 *warmBase = Runtime::getMemoryBaseAddress(module.defaultMemory);
+        size_t memSize = Runtime::getMemoryNumPages(module.defaultMemory) * WASM_BYTES_PER_PAGE;
+        size_t pageSize = faabric::util::HOST_PAGE_SIZE;
+        for (size_t offset = 0; offset < memSize; offset += pageSize) {
+            if (memcmp(hotBase + offset, warmBase + offset, pageSize) != 0) {
+                memcpy(hotBase + offset, warmBase + offset, pageSize);
+            }
+        }
+
+        hotZygote->writeMemoryToFd(fd);
+
+        PROF_END(hotZygoteCapture)
+
+        replaceCachedModule(key, hotZygote, true);
+
+        return true;
+    }
+
+    /**
+     * Functions which dlopen libraries (e.g. Python importing C extensions) have to
+     * link, instantiate and initialise them in every fresh module. If configured, we
+     * record which libraries a function has loaded and rebuild its base zygote with
+     * them already open, so clones find them loaded and dlopen just returns the handle.
+     *
+     * The libraries are loaded into a clone of the current zygote rather than copied
+     * from the calling module, so nothing else from the call ends up in the zygote.
+     *
+     * Returns true if the zygote was replaced.
+     */
+    bool WasmModuleCache::recordDynamicModules(const faabric::Message &msg,
+                                               const wasm::WAVMWasmModule &module) {
+        conf::FaasmConfig &conf = conf::getFaasmConfig();
+        if (conf.preloadDynamicModules != "on" || !msg.snapshotkey().empty()) {
+            return false;
+        }
+
+        std::vector<std::string> paths = module.getDynamicModulePaths();
+        if (paths.empty()) {
+            return false;
+        }
+
+        const std::string key = getBaseCachedModuleKey(msg);
+        std::shared_ptr<wasm::WAVMWasmModule> oldZygote;
+        {
+            faabric::util::SharedLock lock(mx);
+            auto it = cachedModuleMap.find(key);
+            if (it == cachedModuleMap.end()) {
+                return false;
+            }
+
+            // Handles and table layout depend on load order, so only extend the zygote
+            // when it has loaded a prefix of what the function has
+            std::vector<std::string> zygotePaths = it->second.module->getDynamicModulePaths();
+            if (zygotePaths.size() >= paths.size() ||
+                !std::equal(zygotePaths.begin(), zygotePaths.end(), paths.begin())) {
+                return false;
+            }
+
+            // Only one caller rebuilds the zygote
+            if (it->second.rebuilding.exchange(true)) {
+                return false;
+            }
+
+            oldZygote = it->second.module;
+        }
+
+        // Clear the flag however we leave, including when something throws
+        struct RebuildingGuard {
+            WasmModuleCache &cache;
+            const std::string &key;
+            const std::shared_ptr<wasm::WAVMWasmModule> &oldZygote;
+
+            ~RebuildingGuard() {
+                cache.clearRebuilding(key, oldZygote);
+            }
+        } rebuildingGuard{*this, key, oldZygote};
+
+        const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+        logger->debug("Preloading {} dynamic modules into zygote for {}", paths.size(), key);
+
+        PROF_START(zygoteDynamicPreload)
+
+        int fd = createZygoteFd(key);
+        std::shared_ptr<wasm::WAVMWasmModule> preloadedZygote = newZygote(fd);
+        *preloadedZygote = *oldZygote;
+
+        // Failures leave the old zygote in place
+        try {
+            preloadedZygote->preloadDynamicModules(paths);
+        } catch (std::exception &e) {
+            logger->warn("Failed to preload dynamic modules for {}: {}", key, e.what());
+            return false;
+        }
+
+        preloadedZygote->writeMemoryToFd(fd);
+
+        PROF_END(zygoteDynamicPreload)
+
+        replaceCachedModule(key, preloadedZygote, false);
+
+        return true;
+    }
+
+    /**
+     * Lets the zygote be rebuilt again. If it's already been replaced, the new entry
+     * won't have the flag set by this rebuild so is left alone.
+     */
+    void WasmModuleCache::clearRebuilding(const std::string &key,
+                                          const std::shared_ptr<wasm::WAVMWasmModule> &oldZygote) {
+        faabric::util::SharedLock lock(mx);
+        auto it = cachedModuleMap.find(key);
+        if (it != cachedModuleMap.end() && it->second.module == oldZygote) {
+            it->second.rebuilding = false;
+        }
+    }
+
+    /**
+     * Swaps in a new zygote for a key, keeping the existing entry's stats. The old
+     * zygote is dropped once the lock is released.
+     */
+    void WasmModuleCache::replaceCachedModule(const std::string &key,
+                                              const std::shared_ptr<wasm::WAVMWasmModule> &module,
+                                              bool hot) {
+        std::vector<std::shared_ptr<wasm::WAVMWasmModule>> evicted;
+        faabric::util::FullLock lock(mx);
+
+        uint64_t hits = 1;
+        auto it = cachedModuleMap.find(key);
+        if (it != cachedModuleMap.end()) {
+            totalCachedBytes -= it->second.usage.memoryBytes + it->second.usage.fdBytes;
+            hits = it->second.hits;
+            evicted.emplace_back(std::move(it->second.module));
+        }
+
+        addCachedModule(key, module);
+        CachedModuleEntry &entry = cachedModuleMap[key];
+        entry.hits = hits;
+        entry.hot = entry.hot || hot;
+        entry.rebuilding = false;
+
+        std::vector<std::shared_ptr<wasm::WAVMWasmModule>> moreEvicted = evictIfNeeded(key);
+        evicted.insert(evicted.end(), moreEvicted.begin(), moreEvicted.end());
+    }
+
     /**
      * There are two kinds of cached module here, the "base" cached module, i.e. the
      * default module with its zygote function executed, (same for all instances),
      * or one of many "special" cached modules, those restored from snapshots captured at
      * arbitrary points (e.g. when spawning a thread).
+     *
+     * Special modules with versioned keys are built up incrementally from deltas.
+     *
+     * The returned pointer keeps the module alive even if it's evicted in the meantime.
      */
-    wasm::WAVMWasmModule &WasmModuleCache::getCachedModule(const faabric::Message &msg) {
+    std::shared_ptr<wasm::WAVMWasmModule> WasmModuleCache::getCachedModule(const faabric::Message &msg) {
         const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
 
         // Get the keys for both types of cached module
         const std::string baseKey = getBaseCachedModuleKey(msg);
         const std::string specialKey = getCachedModuleKey(msg);
 
+        // Check if we already have the module
+        std::shared_ptr<wasm::WAVMWasmModule> cachedModule = getCachedModuleIfExists(specialKey);
+        if (cachedModule) {
+            return cachedModule;
+        }
+
+        std::vector<std::shared_ptr<wasm::WAVMWasmModule>> evicted;
+
         // Check for the base cached module
-        if (getCachedModuleCount(baseKey) == 0) {
+        std::shared_ptr<wasm::WAVMWasmModule> baseModule = getCachedModuleIfExists(baseKey);
+        if (!baseModule) {
             faabric::util::FullLock lock(mx);
             if (cachedModuleMap.count(baseKey) == 0) {
                 // Instantiate the base module
                 logger->debug("Creating new base zygote: {}", baseKey);
-                wasm::WAVMWasmModule &module = cachedModuleMap[baseKey];
-                module.bindToFunction(msg);
+                int fd = createZygoteFd(baseKey);
+                std::shared_ptr<wasm::WAVMWasmModule> module = newZygote(fd);
+                module->bindToFunction(msg);
 
                 // Write memory to fd (to allow copy-on-write cloning)
-                int fd = memfd_create(baseKey.c_str(), 0);
-                module.writeMemoryToFd(fd);
+                module->writeMemoryToFd(fd);
+
+                baseModule = addCachedModule(baseKey, module);
+                std::vector<std::shared_ptr<wasm::WAVMWasmModule>> baseEvicted = evictIfNeeded(baseKey);
+                evicted.insert(evicted.end(), baseEvicted.begin(), baseEvicted.end());
+            } else {
+                baseModule = cachedModuleMap[baseKey].module;
             }
         }
 
         // Stop now if we're just looking for the base cached module
-        if(specialKey == baseKey) {
-            return cachedModuleMap[baseKey];
+        if (specialKey == baseKey) {
+            return baseModule;
         }
 
-        // See if we already have the special cached module
-        if (getCachedModuleCount(specialKey) == 0) {
-            faabric::util::FullLock lock(mx);
-            if (cachedModuleMap.count(specialKey) == 0) {
-                // Get the base module and the special module
-                logger->debug("Creating new special zygote: {}", specialKey);
-                wasm::WAVMWasmModule &baseModule = cachedModuleMap[baseKey];
-                wasm::WAVMWasmModule &specialModule = cachedModuleMap[specialKey];
-
-                // Clone the special module from the base one
-                specialModule = baseModule;
+        // Versioned snapshots are built from the previous version plus a delta. The
+        // previous version will in turn be built from the one before if not cached.
+        std::shared_ptr<wasm::WAVMWasmModule> sourceModule = baseModule;
+        std::string restoreKey = specialKey;
+        size_t restoreSize = msg.snapshotsize();
 
-                // Restore the special module
-                specialModule.restoreFromState(specialKey, msg.snapshotsize());
+        std::string snapshotBaseKey;
+        int snapshotVersion;
+        if (wasm::parseVersionedSnapshotKey(specialKey, snapshotBaseKey, snapshotVersion)) {
+            faabric::state::State &state = faabric::state::getGlobalState();
 
-                // Write memory to fd
-                int fd = memfd_create(specialKey.c_str(), 0);
-                specialModule.writeMemoryToFd(fd);
+            // Only the base is restored straight from its key, later versions work out
+            // the size of their own delta
+            std::string previousKey = wasm::getVersionedSnapshotKey(snapshotBaseKey, snapshotVersion - 1);
+            faabric::Message previousMsg = msg;
+            previousMsg.set_snapshotkey(previousKey);
+            if (snapshotVersion == 1) {
+                previousMsg.set_snapshotsize(state.getStateSize(msg.user(), previousKey));
+            } else {
+                previousMsg.set_snapshotsize(0);
             }
+            sourceModule = getCachedModule(previousMsg);
+
+            restoreKey = wasm::getSnapshotDeltaKey(snapshotBaseKey, snapshotVersion);
+            restoreSize = state.getStateSize(msg.user(), restoreKey);
+        }
+
+        faabric::util::FullLock lock(mx);
+        if (cachedModuleMap.count(specialKey) > 0) {
+            return cachedModuleMap[specialKey].module;
         }
 
-        return cachedModuleMap[specialKey];
+        // Clone the special module from its source
+        logger->debug("Creating new special zygote: {}", specialKey);
+        int fd = createZygoteFd(specialKey);
+        std::shared_ptr<wasm::WAVMWasmModule> specialModule = newZygote(fd);
+        *specialModule = *sourceModule;
+
+        // Restore the special module
+        specialModule->restoreFromState(restoreKey, restoreSize);
+
+        // Write memory to fd
+        specialModule->writeMemoryToFd(fd);
+
+        addCachedModule(specialKey, specialModule);
+        std::vector<std::shared_ptr<wasm::WAVMWasmModule>> specialEvicted = evictIfNeeded(specialKey);
+        evicted.insert(evicted.end(), specialEvicted.begin(), specialEvicted.end());
+
+        return specialModule;
     }
 
     void WasmModuleCache::clear() {
-        cachedModuleMap.clear();
+        std::unordered_map<std::string, CachedModuleEntry> oldMap;
+
+        {
+            faabric::util::FullLock lock(mx);
+            oldMap.swap(cachedModuleMap);
+            totalCachedBytes = 0;
+        }
     }
-}
\ No newline at end of file
+}
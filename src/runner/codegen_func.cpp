@@ -1,93 +1,115 @@
 #include <faabric/util/logging.h>
 #include <boost/filesystem.hpp>
 #include <faabric/util/func.h>
+#include <storage/CodegenPool.h>
 #include <storage/FileLoader.h>
 #include <faabric/util/config.h>
-#include <faabric/util/environment.h>
-#include <faabric/util/locks.h>
 
 using namespace boost::filesystem;
 
-void codegenForFunc(const std::string &user, const std::string &func) {
+/**
+ * Returns true if code was generated, false if it was up to date. Throws if there's no
+ * valid function to generate code for, so the codegen pool counts it as failed.
+ */
+bool codegenForFunc(const std::string &user, const std::string &func, bool skipIfUnchanged) {
     const std::shared_ptr<spdlog::logger> logger = faabric::util::getLogger();
 
     faabric::Message msg = faabric::util::messageFactory(user, func);
     if (!faabric::util::isValidFunction(msg)) {
-        logger->warn("Invalid function: {}/{}", user, func);
-        return;
+        throw std::runtime_error("Invalid function: " + user + "/" + func);
     }
 
     logger->info("Generating machine code for {}/{}", user, func);
     storage::FileLoader &loader = storage::getFileLoader();
-    loader.codegenForFunction(msg);
+    bool generated = loader.codegenForFunction(msg, skipIfUnchanged);
+    if (!generated) {
+        logger->info("Machine code for {}/{} up to date", user, func);
+    }
+
+    return generated;
+}
+
+void addUserJobs(storage::CodegenPool &pool, const std::string &user, bool skipIfUnchanged) {
+    faabric::util::SystemConfig &conf = faabric::util::getSystemConfig();
+
+    boost::filesystem::path path(conf.functionDir);
+    path.append(user);
+
+    if (!boost::filesystem::is_directory(path)) {
+        throw std::runtime_error("Expected " + path.string() + " to be a directory");
+    }
+
+    for (directory_iterator iter(path), end; iter != end; iter++) {
+        std::string func = iter->path().filename().string();
+        faabric::Message msg = faabric::util::messageFactory(user, func);
+        std::string wasmPath = faabric::util::getFunctionFile(msg);
+        uintmax_t size = exists(wasmPath) ? file_size(wasmPath) : 0;
+
+        pool.addJob(user + "/" + func, size, [user, func, skipIfUnchanged] {
+            return codegenForFunc(user, func, skipIfUnchanged);
+        });
+    }
 }
 
+/**
+ * Usage:
+ *   codegen_func <user> <function>   - codegen for a single function
+ *   codegen_func <user>              - codegen for all of a user's functions
+ *   codegen_func --all [--force]     - codegen for every function in the function store,
+ *                                      skipping any that are up to date unless forced
+ */
 int main(int argc, char *argv[]) {
     faabric::util::initLogging();
     const std::shared_ptr<spdlog::logger> logger = faabric::util::getLogger();
 
-    if (argc == 3) {
+    if (argc >= 2 && std::string(argv[1]) == "--all") {
+        bool force = argc == 3 && std::string(argv[2]) == "--force";
+
+        faabric::util::SystemConfig &conf = faabric::util::getSystemConfig();
+        logger->info("Running codegen for all functions in {}", conf.functionDir);
+
+        storage::CodegenPool pool;
+        for (directory_iterator iter(conf.functionDir), end; iter != end; iter++) {
+            if (is_directory(iter->path())) {
+                addUserJobs(pool, iter->path().filename().string(), !force);
+            }
+        }
+
+        pool.run();
+        pool.printReport();
+
+        return pool.getFailedCount() > 0 ? 1 : 0;
+    } else if (argc == 3) {
         std::string user = argv[1];
         std::string func = argv[2];
 
         logger->info("Running codegen for function {}/{}", user, func);
-        codegenForFunc(user, func);
+        try {
+            codegenForFunc(user, func, false);
+        } catch (std::runtime_error &e) {
+            logger->error(e.what());
+            return 1;
+        }
     } else if (argc == 2) {
         std::string user = argv[1];
 
         faabric::util::SystemConfig &conf = faabric::util::getSystemConfig();
         logger->info("Running codegen for user {} on dir {}", user, conf.functionDir);
 
-        boost::filesystem::path path(conf.functionDir);
-        path.append(user);
-
-        if (!boost::filesystem::is_directory(path)) {
-            logger->error("Expected {} to be a directory", path.string());
+        storage::CodegenPool pool;
+        try {
+            addUserJobs(pool, user, false);
+        } catch (std::runtime_error &e) {
+            logger->error(e.what());
             return 1;
         }
 
-        boost::filesystem::directory_iterator iter(path), end;
-        std::mutex mx;
-
-        unsigned int nThreads = faabric::util::getUsableCores();
-        std::vector<std::thread> threads;
-
-        for (unsigned int i = 0; i < nThreads; i++) {
-            threads.emplace_back([&iter, &mx, &end, &logger, &user] {
-                logger->info("Spawning codegen thread");
-
-                while (true) {
-                    std::string thisPath;
-
-                    {
-                        // Get lock
-                        faabric::util::UniqueLock lock(mx);
+        pool.run();
+        pool.printReport();
 
-                        // Check if we've got more to do
-                        if (iter == end) {
-                            logger->info("Codegen thread finished");
-                            break;
-                        }
-
-                        // Get path and increment
-                        thisPath = iter->path().string();
-                        iter++;
-                    }
-
-                    directory_entry subPath(thisPath);
-                    std::string functionName = subPath.path().filename().string();
-                    codegenForFunc(user, functionName);
-                }
-            });
-        }
-
-        for (auto &t : threads) {
-            if (t.joinable()) {
-                t.join();
-            }
-        }
+        return pool.getFailedCount() > 0 ? 1 : 0;
     } else {
-        logger->error("Must provide function user and optional function name");
+        logger->error("Must provide function user and optional function name, or --all");
         return 0;
     }
-}
\ No newline at end of file
+}
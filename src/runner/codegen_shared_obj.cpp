@@ -1,66 +1,49 @@
 #include <faabric/util/logging.h>
 #include <boost/filesystem.hpp>
+#include <storage/CodegenPool.h>
 #include <storage/FileLoader.h>
-#include <faabric/util/environment.h>
-#include <faabric/util/locks.h>
 #include <faabric/util/string_tools.h>
 
 using namespace boost::filesystem;
 
 
-void codegenForDirectory(std::string &inputPath) {
+int codegenForDirectory(std::string &inputPath, bool skipIfUnchanged) {
     const std::shared_ptr<spdlog::logger> logger = faabric::util::getLogger();
     logger->info("Running codegen on directory {}", inputPath);
     storage::FileLoader &loader = storage::getFileLoader();
 
-    // Iterate through the directory
-    path inputFilePath(inputPath);
-    recursive_directory_iterator iter(inputFilePath), end;
-    std::mutex mx;
-
-    // Run multiple threads to do codegen
-    unsigned int nThreads = faabric::util::getUsableCores();
-    std::vector<std::thread> threads;
-
-    for (unsigned int i = 0; i < nThreads; i++) {
-        threads.emplace_back([&iter, &mx, &end, &logger, &loader] {
-            logger->info("Spawning codegen thread");
-
-            while (true) {
-                std::string thisPath;
-
-                {
-                    // Get lock
-                    faabric::util::UniqueLock lock(mx);
-
-                    // Check if we've got more to do
-                    if (iter == end) {
-                        logger->info("Codegen thread finished");
-                        break;
-                    }
-
-                    // Get path and increment
-                    thisPath = iter->path().string();
-                    iter++;
-                }
+    // Add a job for every shared object in the directory
+    storage::CodegenPool pool;
+    for (recursive_directory_iterator iter(inputPath), end; iter != end; iter++) {
+        const std::string thisPath = iter->path().string();
+        const std::string fileName = iter->path().filename().string();
+        if (!faabric::util::endsWith(fileName, ".so") && !faabric::util::endsWith(fileName, ".wasm")) {
+            continue;
+        }
 
-                directory_entry f(thisPath);
-                const std::string fileName = f.path().filename().string();
-                if (faabric::util::endsWith(fileName, ".so") || faabric::util::endsWith(fileName, ".wasm")) {
-                    logger->info("Generating machine code for {}", thisPath);
-                    loader.codegenForSharedObject(thisPath);
-                }
+        pool.addJob(thisPath, file_size(iter->path()), [&logger, &loader, thisPath, skipIfUnchanged] {
+            logger->info("Generating machine code for {}", thisPath);
+            bool generated = loader.codegenForSharedObject(thisPath, skipIfUnchanged);
+            if (!generated) {
+                logger->info("Machine code for {} up to date", thisPath);
             }
+
+            return generated;
         });
     }
 
-    for (auto &t : threads) {
-        if (t.joinable()) {
-            t.join();
-        }
-    }
+    pool.run();
+    pool.printReport();
+
+    return pool.getFailedCount() > 0 ? 1 : 0;
 }
 
+/**
+ * Usage:
+ *   codegen_shared_obj <file>               - codegen for a single shared object
+ *   codegen_shared_obj <dir> [--force]      - codegen for all shared objects in the directory,
+ *                                             skipping any that are up to date unless forced
+ */
 int main(int argc, char *argv[]) {
     faabric::util::initLogging();
     const std::shared_ptr<spdlog::logger> logger = faabric::util::getLogger();
@@ -72,7 +55,8 @@ int main(int argc, char *argv[]) {
 
     std::string inputPath = argv[1];
     if (is_directory(inputPath)) {
-        codegenForDirectory(inputPath);
+        bool force = argc == 3 && std::string(argv[2]) == "--force";
+        return codegenForDirectory(inputPath, !force);
     } else {
         storage::FileLoader &loader = storage::getFileLoader();
         loader.codegenForSharedObject(inputPath);
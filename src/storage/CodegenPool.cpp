@@ -0,0 +1,117 @@
+#include "CodegenPool.h"
+
+#include <conf/FaasmConfig.h>
+#include <faabric/util/environment.h>
+#include <faabric/util/logging.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+// Number of slowest jobs listed in the report
+#define CODEGEN_REPORT_SLOWEST 10
+
+namespace storage {
+    static double millisSince(const std::chrono::steady_clock::time_point &start) {
+        std::chrono::duration<double, std::milli> diff = std::chrono::steady_clock::now() - start;
+        return diff.count();
+    }
+
+    CodegenPool::CodegenPool(int nThreadsIn) {
+        if (nThreadsIn <= 0) {
+            nThreadsIn = conf::getFaasmConfig().codegenThreads;
+        }
+
+        nThreads = nThreadsIn > 0 ? nThreadsIn : faabric::util::getUsableCores();
+    }
+
+    void CodegenPool::addJob(const std::string &name, uintmax_t size, std::function<bool()> func) {
+        Job job;
+        job.name = name;
+        job.size = size;
+        job.func = std::move(func);
+        jobs.emplace_back(std::move(job));
+    }
+
+    void CodegenPool::run() {
+        const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+
+        std::stable_sort(jobs.begin(), jobs.end(), [](const Job &a, const Job &b) {
+            return a.size > b.size;
+        });
+
+        unsigned int poolSize = std::min<unsigned int>(nThreads, jobs.size());
+        logger->info("Running {} codegen jobs with {} threads", jobs.size(), poolSize);
+
+        const auto start = std::chrono::steady_clock::now();
+
+        std::atomic<size_t> nextIdx = 0;
+        std::vector<std::thread> threads;
+        for (unsigned int i = 0; i < poolSize; i++) {
+            threads.emplace_back([this, &nextIdx, &logger] {
+                size_t idx;
+                while ((idx = nextIdx++) < jobs.size()) {
+                    Job &job = jobs.at(idx);
+
+                    const auto jobStart = std::chrono::steady_clock::now();
+                    try {
+                        job.outcome = job.func() ? CodegenOutcome::GENERATED : CodegenOutcome::SKIPPED;
+                    } catch (std::exception &e) {
+                        logger->error("Codegen failed for {}: {}", job.name, e.what());
+                        job.outcome = CodegenOutcome::FAILED;
+                    }
+                    job.durationMs = millisSince(jobStart);
+                }
+            });
+        }
+
+        for (auto &t : threads) {
+            if (t.joinable()) {
+                t.join();
+            }
+        }
+
+        totalDurationMs = millisSince(start);
+    }
+
+    void CodegenPool::printReport() {
+        const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+
+        int nGenerated = 0;
+        int nSkipped = 0;
+        double cpuMs = 0;
+        for (const auto &job : jobs) {
+            nGenerated += job.outcome == CodegenOutcome::GENERATED;
+            nSkipped += job.outcome == CodegenOutcome::SKIPPED;
+            cpuMs += job.durationMs;
+        }
+
+        std::vector<const Job *> slowest;
+        for (const auto &job : jobs) {
+            slowest.push_back(&job);
+        }
+        std::sort(slowest.begin(), slowest.end(), [](const Job *a, const Job *b) {
+            return a->durationMs > b->durationMs;
+        });
+        slowest.resize(std::min<size_t>(slowest.size(), CODEGEN_REPORT_SLOWEST));
+
+        logger->info("--- Codegen report ---");
+        logger->info("Generated: {}  Skipped: {}  Failed: {}", nGenerated, nSkipped, getFailedCount());
+        logger->info("Wall time: {:.2f}s  Total job time: {:.2f}s", totalDurationMs / 1000, cpuMs / 1000);
+
+        if (!slowest.empty()) {
+            logger->info("Slowest:");
+        }
+
+        for (const Job *job : slowest) {
+            logger->info("  {:>10.2f}s  {}", job->durationMs / 1000, job->name);
+        }
+    }
+
+    int CodegenPool::getFailedCount() {
+        return std::count_if(jobs.begin(), jobs.end(), [](const Job &job) {
+            return job.outcome == CodegenOutcome::FAILED;
+        });
+    }
+}
@@ -5,6 +5,7 @@
 #include <wamr/WAMRWasmModule.h>
 #endif
 
+#include <ir_cache/ObjectCache.h>
 #include <wavm/WAVMWasmModule.h>
 
 #include <faabric/util/config.h>
@@ -25,12 +26,32 @@ namespace storage {
 #else
             return wasm::wamrCodegen(bytes);
 #endif
-        } else {
+        }
+
+        // Identical wasm only needs generating once
+        wasm::ObjectCache &objectCache = wasm::getObjectCache();
+        if (!objectCache.isEnabled()) {
             return wasm::wavmCodegen(bytes);
         }
+
+        std::string objectKey = wasm::getObjectCacheKey(bytes);
+        std::shared_ptr<wasm::MappedObjectFile> cachedObject = objectCache.load(objectKey);
+        if (cachedObject) {
+            faabric::util::getLogger()->debug("Using cached object code {}", objectKey);
+            return std::vector<uint8_t>(cachedObject->data(), cachedObject->data() + cachedObject->size());
+        }
+
+        std::vector<uint8_t> objBytes = wasm::wavmCodegen(bytes);
+        objectCache.store(objectKey, objBytes);
+
+        return objBytes;
     }
 
-    void FileLoader::codegenForFunction(faabric::Message &msg) {
+    /**
+     * Returns false if codegen was skipped because the existing object file was generated
+     * from the same wasm with the same options.
+     */
+    bool FileLoader::codegenForFunction(faabric::Message &msg, bool skipIfUnchanged) {
         std::vector<uint8_t> bytes = loadFunctionWasm(msg);
 
         if (bytes.empty()) {
@@ -38,28 +59,87 @@ namespace storage {
             throw std::runtime_error("Loaded empty bytes for " + funcStr);
         }
 
+        faabric::util::SystemConfig &conf = faabric::util::getSystemConfig();
+        const std::string objectFilePath = conf.wasmVm == "wamr" ?
+                                           faabric::util::getFunctionAotFile(msg) :
+                                           faabric::util::getFunctionObjectFile(msg);
+
+        const std::string hash = getCodegenHash(bytes);
+        if (skipIfUnchanged && isCodegenUpToDate(objectFilePath, hash)) {
+            return false;
+        }
+
         std::vector<uint8_t> objBytes = doCodegen(bytes);
 
-        faabric::util::SystemConfig &conf = faabric::util::getSystemConfig();
         if (conf.wasmVm == "wamr") {
             uploadFunctionAotFile(msg, objBytes);
         } else {
             uploadFunctionObjectFile(msg, objBytes);
         }
+
+        writeCodegenHash(objectFilePath, hash);
+
+        return true;
     }
 
-    void FileLoader::codegenForSharedObject(const std::string &inputPath) {
-        // Generate the machine code
+    bool FileLoader::codegenForSharedObject(const std::string &inputPath, bool skipIfUnchanged) {
         std::vector<uint8_t> bytes = loadSharedObjectWasm(inputPath);
+
+        faabric::util::SystemConfig &conf = faabric::util::getSystemConfig();
+        const std::string objectFilePath = faabric::util::getSharedObjectObjectFile(inputPath);
+
+        const std::string hash = getCodegenHash(bytes);
+        if (skipIfUnchanged && conf.wasmVm != "wamr" && isCodegenUpToDate(objectFilePath, hash)) {
+            return false;
+        }
+
+        // Generate the machine code
         std::vector<uint8_t> objBytes = doCodegen(bytes);
 
         // Do the upload
-        faabric::util::SystemConfig &conf = faabric::util::getSystemConfig();
         if (conf.wasmVm == "wamr") {
             uploadSharedObjectAotFile(inputPath, objBytes);
         } else {
             uploadSharedObjectObjectFile(inputPath, objBytes);
+            writeCodegenHash(objectFilePath, hash);
+        }
+
+        return true;
+    }
+
+    /**
+     * Identifies the wasm and everything else that affects the generated code
+     */
+    std::string getCodegenHash(const std::vector<uint8_t> &wasmBytes) {
+        faabric::util::SystemConfig &conf = faabric::util::getSystemConfig();
+        return conf.wasmVm + ":" + wasm::getObjectCacheKey(wasmBytes);
+    }
+
+    /**
+     * The hash of what each object file was generated from is kept alongside it
+     */
+    static std::string getCodegenHashPath(const std::string &objectFilePath) {
+        return objectFilePath + ".hash";
+    }
+
+    bool isCodegenUpToDate(const std::string &objectFilePath, const std::string &hash) {
+        const std::string hashPath = getCodegenHashPath(objectFilePath);
+        if (!boost::filesystem::exists(objectFilePath) || !boost::filesystem::exists(hashPath)) {
+            return false;
         }
+
+        std::vector<uint8_t> storedHash = faabric::util::readFileToBytes(hashPath);
+        return std::string(storedHash.begin(), storedHash.end()) == hash;
+    }
+
+    void writeCodegenHash(const std::string &objectFilePath, const std::string &hash) {
+        // Object files may have been uploaded somewhere else
+        if (!boost::filesystem::exists(objectFilePath)) {
+            return;
+        }
+
+        std::vector<uint8_t> hashBytes(hash.begin(), hash.end());
+        faabric::util::writeBytesToFile(getCodegenHashPath(objectFilePath), hashBytes);
     }
 
     void checkFileExists(const std::string &path) {
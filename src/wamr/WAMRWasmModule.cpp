@@ -57,6 +57,43 @@ namespace wasm {
 
     // ----- Module lifecycle -----
     void WAMRWasmModule::bindToFunction(const faabric::Message &msg) {
+        storage::FileLoader &functionLoader = storage::getFileLoader();
+        loadAndInstantiate(msg, functionLoader.loadFunctionWamrAotFile(msg), Wasm_Module_AoT);
+    }
+
+    /**
+     * Runs the function's wasm in WAMR's interpreter rather than from AOT object code,
+     * so it can be executed without waiting for codegen.
+     */
+    void WAMRWasmModule::bindToFunctionInterpreted(const faabric::Message &msg) {
+        storage::FileLoader &functionLoader = storage::getFileLoader();
+        loadAndInstantiate(msg, functionLoader.loadFunctionWasm(msg), Wasm_Module_Bytecode);
+    }
+
+    /**
+     * Imports are linked against the registered natives when the module is loaded, and
+     * any left unlinked trap if called. Only interpreted (bytecode) modules are checked.
+     */
+    bool WAMRWasmModule::allImportsResolved() {
+        if (wasmModule == nullptr || wasmModule->module_type != Wasm_Module_Bytecode) {
+            return true;
+        }
+
+        auto bytecodeModule = reinterpret_cast<WASMModule *>(wasmModule);
+        for (uint32 i = 0; i < bytecodeModule->import_function_count; i++) {
+            const WASMFunctionImport &import = bytecodeModule->import_functions[i].u.function;
+            if (import.func_ptr_linked == nullptr) {
+                faabric::util::getLogger()->debug("WAMR can't resolve import {}.{}", import.module_name,
+                                                  import.field_name);
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void WAMRWasmModule::loadAndInstantiate(const faabric::Message &msg, std::vector<uint8_t> bytes,
+                                            uint32_t expectedType) {
         const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
         
         // Set up the module
@@ -67,15 +104,14 @@ namespace wasm {
         // Prepare the filesystem
         filesystem.prepareFilesystem();
 
-        // Load the wasm file
-        storage::FileLoader &functionLoader = storage::getFileLoader();
-        std::vector<uint8_t> aotFileBytes = functionLoader.loadFunctionWamrAotFile(msg);
+        // Loaded bytecode modules refer back to the bytes, so these must outlive the module
+        moduleBytes = std::move(bytes);
 
         // Load wasm
         errorBuffer.reserve(ERROR_BUFFER_SIZE);
         wasmModule = wasm_runtime_load(
-                aotFileBytes.data(),
-                aotFileBytes.size(),
+                moduleBytes.data(),
+                moduleBytes.size(),
                 errorBuffer.data(),
                 ERROR_BUFFER_SIZE
         );
@@ -95,7 +131,7 @@ namespace wasm {
                 ERROR_BUFFER_SIZE
         );
 
-        if(moduleInstance->module_type != Wasm_Module_AoT) {
+        if(moduleInstance->module_type != expectedType) {
             throw std::runtime_error("WAMR module had unexpected type: " + std::to_string(moduleInstance->module_type));
         }
     }
@@ -112,30 +148,38 @@ namespace wasm {
 
         executionEnv = wasm_runtime_create_exec_env(moduleInstance, STACK_SIZE);
 
-        // Run wasm initialisers
-        executeFunction(WASM_CTORS_FUNC_NAME);
+        // Run wasm initialisers, then the main function
+        bool success = executeFunction(WASM_CTORS_FUNC_NAME) && executeFunction(ENTRY_FUNC_NAME);
 
-        // Run the main function
-        executeFunction(ENTRY_FUNC_NAME);
+        // Record the return value
+        msg.set_returnvalue(success ? 0 : 1);
 
-        return true;
+        return success;
     }
 
-    void WAMRWasmModule::executeFunction(const std::string &funcName) {
+    bool WAMRWasmModule::executeFunction(const std::string &funcName) {
         const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
 
         WASMFunctionInstanceCommon *func = wasm_runtime_lookup_function(
                 moduleInstance, funcName.c_str(), nullptr
         );
 
-        // Invoke the function
+        if (func == nullptr) {
+            logger->error("Function {} not found in {}/{}", funcName, boundUser, boundFunction);
+            return false;
+        }
+
+        // Invoke the function. Errors at runtime are recorded as exceptions on the module
+        // instance, not in the error buffer.
         bool success = wasm_runtime_call_wasm(executionEnv, func, 0, nullptr);
         if (success) {
             logger->debug("{} finished", funcName);
         } else {
-            std::string errorMessage(errorBuffer.data());
-            logger->error("Function failed: {}", errorMessage);
+            const char *exception = wasm_runtime_get_exception(moduleInstance);
+            logger->error("Function {} failed: {}", funcName, exception == nullptr ? "unknown error" : exception);
         }
+
+        return success;
     }
 
     bool WAMRWasmModule::isBound() {
@@ -143,8 +187,16 @@ namespace wasm {
     }
 
     void WAMRWasmModule::tearDown() {
-        wasm_runtime_destroy_exec_env(executionEnv);
-        wasm_runtime_deinstantiate(moduleInstance);
+        // Modules can be dropped without having executed, e.g. when rebinding
+        if (executionEnv != nullptr) {
+            wasm_runtime_destroy_exec_env(executionEnv);
+            executionEnv = nullptr;
+        }
+
+        if (moduleInstance != nullptr) {
+            wasm_runtime_deinstantiate(moduleInstance);
+            moduleInstance = nullptr;
+        }
     }
 
     uint32_t WAMRWasmModule::mmapMemory(uint32_t length) {
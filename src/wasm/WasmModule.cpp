@@ -4,12 +4,16 @@
 #include <faabric/util/config.h>
 #include <faabric/util/func.h>
 #include <faabric/util/locks.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/uio.h>
 
 #include <boost/filesystem.hpp>
 #include <sstream>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <faabric/util/memory.h>
+#include <wasm/serialisation.h>
 
 
 namespace wasm {
@@ -44,9 +48,16 @@ namespace wasm {
     }
 
     size_t WasmModule::snapshotToState(const std::string &stateKey) {
-        const std::vector<uint8_t> snapData = snapshotToMemory();
-        unsigned long stateSize = snapData.size();
+        // Work out the size up front so we can write straight into the state value
+        size_t stateSize = prepareSnapshot();
 
+        return writeSnapshotToState(stateKey, stateSize);
+    }
+
+    /**
+     * Writes the prepared snapshot straight into the given state value
+     */
+    size_t WasmModule::writeSnapshotToState(const std::string &stateKey, size_t stateSize) {
         faabric::state::State &state = faabric::state::getGlobalState();
         const std::shared_ptr<faabric::state::StateKeyValue> &stateKv = state.getKV(
                 getBoundUser(),
@@ -54,7 +65,15 @@ namespace wasm {
                 stateSize
         );
 
-        stateKv->set(snapData.data());
+        MemoryRegionBuf buf(stateKv->get(), stateSize);
+        std::ostream outStream(&buf);
+        doSnapshot(outStream);
+
+        if (!outStream || buf.bytesWritten() != stateSize) {
+            throw std::runtime_error("Snapshot did not match its prepared size");
+        }
+
+        stateKv->flagDirty();
         stateKv->pushFull();
 
         return stateSize;
@@ -69,13 +88,42 @@ namespace wasm {
     }
 
     void WasmModule::restoreFromFile(const std::string &filePath) {
+        // Map snapshots in the mappable layout straight into memory
+        int fd = open(filePath.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            MappableSnapshotHeader header{};
+            bool isMappable = false;
+            try {
+                isMappable = readMappableSnapshotHeader(fd, header);
+                if (isMappable) {
+                    doRestoreFromMappableFile(fd, header);
+                }
+            } catch (const std::exception &e) {
+                close(fd);
+                throw;
+            }
+
+            // Mapping stays valid once the fd is closed
+            close(fd);
+
+            if (isMappable) {
+                return;
+            }
+        }
+
         // Read execution state from file
         std::ifstream inStream(filePath, std::ios::binary);
         doRestore(inStream);
     }
 
     void WasmModule::restoreFromMemory(const std::vector<uint8_t> &data) {
-        std::istringstream inStream(std::string(reinterpret_cast<const char *>(data.data()), data.size()));
+        restoreFromMemory(data.data(), data.size());
+    }
+
+    void WasmModule::restoreFromMemory(const uint8_t *data, size_t dataSize) {
+        // Buffer is only read from
+        MemoryRegionBuf buf(const_cast<uint8_t *>(data), dataSize);
+        std::istream inStream(&buf);
         doRestore(inStream);
     }
 
@@ -91,10 +139,9 @@ namespace wasm {
                 stateSize
         );
 
+        // Restore directly from the state value
         stateKv->pull();
-        uint8_t *snapPtr = stateKv->get();
-        const std::vector<uint8_t> snapData = std::vector<uint8_t>(snapPtr, snapPtr + stateSize);
-        restoreFromMemory(snapData);
+        restoreFromMemory(stateKv->get(), stateSize);
     }
 
     void WasmModule::snapshotToFile(const std::string &filePath) {
@@ -102,13 +149,74 @@ namespace wasm {
         doSnapshot(outStream);
     }
 
+    /**
+     * Writes a snapshot which can be mapped copy-on-write on restore, rather than read
+     * in. Will be larger than a normal snapshot if memory isn't mostly zeroes, but
+     * restoring is near-instant and untouched pages cost nothing.
+     *
+     * Existing snapshots may be mapped by running modules, and pages of a mapping not yet
+     * touched are read from the file, so the file must never be changed in place. The
+     * snapshot is written to a temporary file alongside and renamed over the target
+     * once it's on disk, leaving existing mappings with the old file.
+     */
+    void WasmModule::snapshotToMappableFile(const std::string &filePath) {
+        const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+
+        std::string tmpPath = filePath + ".XXXXXX";
+        int fd = mkstemp(tmpPath.data());
+        if (fd < 0) {
+            logger->error("Failed to create temporary file for {}: {}", filePath, strerror(errno));
+            throw std::runtime_error("Failed to open snapshot file");
+        }
+
+        try {
+            if (fchmod(fd, 0644) != 0) {
+                logger->error("Failed to set mode of {}: {}", tmpPath, strerror(errno));
+                throw std::runtime_error("Failed to write snapshot file");
+            }
+
+            doSnapshotToMappableFile(fd);
+
+            if (fsync(fd) != 0) {
+                logger->error("Failed to sync {}: {}", tmpPath, strerror(errno));
+                throw std::runtime_error("Failed to write snapshot file");
+            }
+        } catch (const std::exception &e) {
+            close(fd);
+            unlink(tmpPath.c_str());
+            throw;
+        }
+
+        close(fd);
+
+        if (rename(tmpPath.c_str(), filePath.c_str()) != 0) {
+            logger->error("Failed to move {} to {}: {}", tmpPath, filePath, strerror(errno));
+            unlink(tmpPath.c_str());
+            throw std::runtime_error("Failed to write snapshot file");
+        }
+    }
+
     std::vector<uint8_t> WasmModule::snapshotToMemory() {
-        std::ostringstream outStream;
+        std::vector<uint8_t> data(prepareSnapshot());
+        snapshotToMemory(data.data(), data.size());
+
+        return data;
+    }
+
+    /**
+     * Writes the snapshot into the given buffer, returning the number of bytes written.
+     * Throws if the buffer isn't big enough.
+     */
+    size_t WasmModule::snapshotToMemory(uint8_t *buffer, size_t bufferSize) {
+        MemoryRegionBuf buf(buffer, bufferSize);
+        std::ostream outStream(&buf);
         doSnapshot(outStream);
 
-        std::string outStr = outStream.str();
+        if (!outStream) {
+            throw std::runtime_error("Snapshot buffer too small");
+        }
 
-        return std::vector<uint8_t>(outStr.begin(), outStr.end());
+        return buf.bytesWritten();
     }
 
     int WasmModule::getStdoutFd() {
@@ -273,6 +381,10 @@ namespace wasm {
         throw std::runtime_error("mapMemoryFromFd not implemented");
     }
 
+    size_t WasmModule::prepareSnapshot() {
+        throw std::runtime_error("prepareSnapshot not implemented");
+    }
+
     void WasmModule::doSnapshot(std::ostream &outStream) {
         throw std::runtime_error("doSnapshot not implemented");
     }
@@ -281,6 +393,14 @@ namespace wasm {
         throw std::runtime_error("doRestore not implemented");
     }
 
+    void WasmModule::doSnapshotToMappableFile(int fd) {
+        throw std::runtime_error("doSnapshotToMappableFile not implemented");
+    }
+
+    void WasmModule::doRestoreFromMappableFile(int fd, const MappableSnapshotHeader &header) {
+        throw std::runtime_error("doRestoreFromMappableFile not implemented");
+    }
+
     uint32_t WasmModule::mmapMemory(uint32_t length) {
         throw std::runtime_error("mmapMemory not implemented");
     }
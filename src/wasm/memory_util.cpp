@@ -0,0 +1,449 @@
+#include "memory_util.h"
+
+#include <faabric/util/locks.h>
+#include <faabric/util/logging.h>
+#include <faabric/util/memory.h>
+
+#include <algorithm>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// See https://www.kernel.org/doc/Documentation/vm/pagemap.txt
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_SWAPPED (1ULL << 62)
+#define PAGEMAP_FILE_OR_SHARED (1ULL << 61)
+#define PAGEMAP_SOFT_DIRTY (1ULL << 55)
+
+// Written to clear_refs to clear all soft-dirty bits
+#define CLEAR_REFS_SOFT_DIRTY "4"
+
+// Number of pagemap entries read per syscall
+#define PAGEMAP_BATCH_SIZE 4096
+
+namespace wasm {
+    /**
+     * Returns the ranges of host pages whose pagemap entries match the given predicate
+     */
+    template<typename F>
+    static std::vector<PageRange> getPageRangesFromPagemap(const uint8_t *base, size_t nBytes, F includePage) {
+        const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+        size_t pageSize = faabric::util::HOST_PAGE_SIZE;
+
+        std::vector<PageRange> ranges;
+        if (nBytes == 0) {
+            return ranges;
+        }
+
+        int fd = open("/proc/self/pagemap", O_RDONLY);
+        if (fd == -1) {
+            logger->error("Failed to open pagemap ({} - {})", errno, strerror(errno));
+            throw std::runtime_error("Failed to open pagemap");
+        }
+
+        size_t nPages = (nBytes + pageSize - 1) / pageSize;
+        size_t firstPage = ((size_t) base) / pageSize;
+
+        std::vector<uint64_t> entries(PAGEMAP_BATCH_SIZE);
+        for (size_t batchStart = 0; batchStart < nPages; batchStart += PAGEMAP_BATCH_SIZE) {
+            size_t batchSize = std::min<size_t>(PAGEMAP_BATCH_SIZE, nPages - batchStart);
+            off_t offset = (off_t) ((firstPage + batchStart) * sizeof(uint64_t));
+
+            ssize_t nRead = pread(fd, entries.data(), batchSize * sizeof(uint64_t), offset);
+            if (nRead != (ssize_t) (batchSize * sizeof(uint64_t))) {
+                close(fd);
+                logger->error("Failed to read pagemap ({} - {})", errno, strerror(errno));
+                throw std::runtime_error("Failed to read pagemap");
+            }
+
+            for (size_t i = 0; i < batchSize; i++) {
+                if (!includePage(entries[i])) {
+                    continue;
+                }
+
+                // Extend the previous range if contiguous
+                size_t pageOffset = (batchStart + i) * pageSize;
+                if (!ranges.empty() && ranges.back().first + ranges.back().second == pageOffset) {
+                    ranges.back().second += pageSize;
+                } else {
+                    ranges.emplace_back(pageOffset, pageSize);
+                }
+            }
+        }
+
+        close(fd);
+
+        return ranges;
+    }
+
+    std::vector<PageRange> getDirtyPageRanges(const uint8_t *base, size_t nBytes) {
+        return getPageRangesFromPagemap(base, nBytes, [](uint64_t entry) {
+            bool isPrivateCopy = (entry & PAGEMAP_PRESENT) && !(entry & PAGEMAP_FILE_OR_SHARED);
+            bool isSwapped = entry & PAGEMAP_SWAPPED;
+            return isPrivateCopy || isSwapped;
+        });
+    }
+
+    std::vector<PageRange> getPopulatedPageRanges(const uint8_t *base, size_t nBytes) {
+        return getPageRangesFromPagemap(base, nBytes, [](uint64_t entry) {
+            return (entry & PAGEMAP_PRESENT) || (entry & PAGEMAP_SWAPPED);
+        });
+    }
+
+    static std::mutex softDirtyMx;
+    static bool softDirtyInUse = false;
+    static int softDirtySupported = -1;
+
+    static bool clearSoftDirtyBits() {
+        int fd = open("/proc/self/clear_refs", O_WRONLY);
+        if (fd == -1) {
+            return false;
+        }
+
+        bool success = write(fd, CLEAR_REFS_SOFT_DIRTY, 1) == 1;
+        close(fd);
+
+        return success;
+    }
+
+    static std::vector<PageRange> getSoftDirtyPageRanges(const uint8_t *base, size_t nBytes) {
+        return getPageRangesFromPagemap(base, nBytes, [](uint64_t entry) {
+            return (entry & PAGEMAP_SOFT_DIRTY) != 0;
+        });
+    }
+
+    /**
+     * The bits are only there if the kernel is built with them, and clear_refs may not
+     * be writable, so check that a write to a scratch page shows up after clearing. Must
+     * be called with the lock held.
+     */
+    static bool isSoftDirtySupported() {
+        if (softDirtySupported != -1) {
+            return softDirtySupported == 1;
+        }
+
+        size_t pageSize = faabric::util::HOST_PAGE_SIZE;
+        void *scratch = mmap(nullptr, pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (scratch == MAP_FAILED) {
+            return false;
+        }
+
+        auto *page = static_cast<volatile uint8_t *>(scratch);
+        const auto *pagePtr = static_cast<const uint8_t *>(scratch);
+        bool supported;
+        try {
+            page[0] = 1;
+            supported = clearSoftDirtyBits() && getSoftDirtyPageRanges(pagePtr, pageSize).empty();
+
+            page[0] = 2;
+            supported = supported && !getSoftDirtyPageRanges(pagePtr, pageSize).empty();
+        } catch (const std::runtime_error &e) {
+            supported = false;
+        }
+
+        munmap(scratch, pageSize);
+
+        faabric::util::getLogger()->debug("Soft-dirty page tracking {}", supported ? "supported" : "not supported");
+        softDirtySupported = supported ? 1 : 0;
+
+        return supported;
+    }
+
+    SoftDirtyTracker::~SoftDirtyTracker() {
+        release();
+    }
+
+    void SoftDirtyTracker::reset() {
+        faabric::util::UniqueLock lock(softDirtyMx);
+        markedRanges.clear();
+
+        if (!tracking) {
+            if (softDirtyInUse || !isSoftDirtySupported()) {
+                return;
+            }
+
+            softDirtyInUse = true;
+            tracking = true;
+        }
+
+        if (!clearSoftDirtyBits()) {
+            faabric::util::getLogger()->warn("Failed to clear soft-dirty bits ({} - {})", errno, strerror(errno));
+            softDirtyInUse = false;
+            tracking = false;
+        }
+    }
+
+    std::vector<PageRange> SoftDirtyTracker::getDirtyPageRangesAndReset(const uint8_t *base, size_t nBytes) {
+        std::vector<PageRange> ranges;
+        if (!isTracking()) {
+            if (nBytes > 0) {
+                ranges.emplace_back(0, nBytes);
+            }
+        } else {
+            ranges = getSoftDirtyPageRanges(base, nBytes);
+
+            // Merge in anything marked, keeping the ranges ordered and disjoint
+            size_t pageSize = faabric::util::HOST_PAGE_SIZE;
+            for (const auto &r : markedRanges) {
+                size_t start = (r.first / pageSize) * pageSize;
+                size_t end = std::min(((r.first + r.second + pageSize - 1) / pageSize) * pageSize, nBytes);
+                if (start < end) {
+                    ranges.emplace_back(start, end - start);
+                }
+            }
+
+            std::sort(ranges.begin(), ranges.end());
+            std::vector<PageRange> merged;
+            for (const auto &r : ranges) {
+                if (!merged.empty() && r.first <= merged.back().first + merged.back().second) {
+                    size_t end = std::max(merged.back().first + merged.back().second, r.first + r.second);
+                    merged.back().second = end - merged.back().first;
+                } else {
+                    merged.push_back(r);
+                }
+            }
+
+            ranges = std::move(merged);
+        }
+
+        // Also tries to start tracking if not already
+        reset();
+
+        return ranges;
+    }
+
+    void SoftDirtyTracker::markDirty(const PageRange &range) {
+        if (isTracking()) {
+            markedRanges.push_back(range);
+        }
+    }
+
+    void SoftDirtyTracker::release() {
+        faabric::util::UniqueLock lock(softDirtyMx);
+        if (tracking) {
+            softDirtyInUse = false;
+            tracking = false;
+        }
+
+        markedRanges.clear();
+    }
+
+    bool SoftDirtyTracker::isTracking() const {
+        return tracking;
+    }
+
+    static bool isZeroPage(const uint8_t *page, size_t pageSize) {
+        const auto *words = reinterpret_cast<const uint64_t *>(page);
+        for (size_t i = 0; i < pageSize / sizeof(uint64_t); i++) {
+            if (words[i] != 0) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    size_t writeNonZeroPages(int fd, const uint8_t *base, const PageRange &range) {
+        size_t pageSize = faabric::util::HOST_PAGE_SIZE;
+        size_t end = range.first + range.second;
+        size_t nBytesWritten = 0;
+
+        size_t pageOffset = range.first;
+        while (pageOffset < end) {
+            if (isZeroPage(base + pageOffset, pageSize)) {
+                pageOffset += pageSize;
+                continue;
+            }
+
+            size_t runStart = pageOffset;
+            while (pageOffset < end && !isZeroPage(base + pageOffset, pageSize)) {
+                pageOffset += pageSize;
+            }
+
+            size_t offset = runStart;
+            while (offset < pageOffset) {
+                ssize_t written = pwrite(fd, base + offset, pageOffset - offset, (off_t) offset);
+                if (written <= 0) {
+                    faabric::util::getLogger()->error("Failed to write pages to fd {} ({} - {})", fd, errno,
+                                                      strerror(errno));
+                    throw std::runtime_error("Failed to write pages to fd");
+                }
+
+                offset += written;
+                nBytesWritten += written;
+            }
+        }
+
+        return nBytesWritten;
+    }
+
+    std::vector<PageRange> getFileDataRanges(int fd, size_t fileSize, size_t minHoleSize) {
+        size_t pageSize = faabric::util::HOST_PAGE_SIZE;
+        std::vector<PageRange> ranges;
+
+        off_t offset = 0;
+        while ((size_t) offset < fileSize) {
+            off_t dataStart = lseek(fd, offset, SEEK_DATA);
+            if (dataStart == -1) {
+                if (errno == ENXIO) {
+                    // No more data
+                    break;
+                }
+
+                // Can't tell where the holes are, so treat it all as data
+                ranges.clear();
+                ranges.emplace_back(0, fileSize);
+                return ranges;
+            }
+
+            off_t dataEnd = lseek(fd, dataStart, SEEK_HOLE);
+            if (dataEnd == -1) {
+                dataEnd = (off_t) fileSize;
+            }
+
+            size_t start = (((size_t) dataStart) / pageSize) * pageSize;
+            size_t end = std::min(((((size_t) dataEnd) + pageSize - 1) / pageSize) * pageSize, fileSize);
+
+            // Skip small holes rather than creating lots of separate mappings
+            if (!ranges.empty() && start <= ranges.back().first + ranges.back().second + minHoleSize) {
+                ranges.back().second = end - ranges.back().first;
+            } else {
+                ranges.emplace_back(start, end - start);
+            }
+
+            offset = dataEnd;
+        }
+
+        return ranges;
+    }
+
+    void discardPageRanges(uint8_t *base, const std::vector<PageRange> &ranges) {
+        for (const auto &r : ranges) {
+            int res = madvise(base + r.first, r.second, MADV_DONTNEED);
+            if (res != 0) {
+                faabric::util::getLogger()->error("Failed to discard {} bytes at offset {} ({} - {})",
+                                                  r.second, r.first, errno, strerror(errno));
+                throw std::runtime_error("Failed to discard pages");
+            }
+        }
+    }
+
+    void findChangedBytes(const uint8_t *memBase, const uint8_t *refBase, size_t start, size_t end,
+                          std::vector<ByteRun> &runs) {
+        size_t i = start;
+        while (i < end) {
+            // Skip unchanged words quickly
+            if (i + sizeof(uint64_t) <= end) {
+                uint64_t memWord;
+                uint64_t refWord = 0;
+                memcpy(&memWord, memBase + i, sizeof(uint64_t));
+                if (refBase != nullptr) {
+                    memcpy(&refWord, refBase + i, sizeof(uint64_t));
+                }
+
+                if (memWord == refWord) {
+                    i += sizeof(uint64_t);
+                    continue;
+                }
+            }
+
+            uint8_t refByte = refBase == nullptr ? 0 : refBase[i];
+            if (memBase[i] == refByte) {
+                i++;
+                continue;
+            }
+
+            // Extend the previous run if contiguous
+            if (!runs.empty() && runs.back().first + runs.back().second == i) {
+                runs.back().second++;
+            } else {
+                runs.emplace_back((uint32_t) i, 1);
+            }
+            i++;
+        }
+    }
+
+    std::vector<uint8_t> serialiseMemoryDiff(const uint8_t *memBase, const std::vector<ByteRun> &runs) {
+        size_t size = sizeof(uint64_t);
+        for (const auto &r : runs) {
+            size += 2 * sizeof(uint32_t) + r.second;
+        }
+
+        std::vector<uint8_t> diff(size);
+        uint8_t *ptr = diff.data();
+
+        uint64_t nRuns = runs.size();
+        memcpy(ptr, &nRuns, sizeof(uint64_t));
+        ptr += sizeof(uint64_t);
+
+        for (const auto &r : runs) {
+            memcpy(ptr, &r.first, sizeof(uint32_t));
+            memcpy(ptr + sizeof(uint32_t), &r.second, sizeof(uint32_t));
+            ptr += 2 * sizeof(uint32_t);
+
+            memcpy(ptr, memBase + r.first, r.second);
+            ptr += r.second;
+        }
+
+        return diff;
+    }
+
+    /**
+     * Walks the runs in a serialised diff, checking it's well formed
+     */
+    template<typename F>
+    static void forEachRun(const uint8_t *diff, size_t diffSize, F f) {
+        if (diffSize < sizeof(uint64_t)) {
+            throw std::runtime_error("Memory diff too small");
+        }
+
+        uint64_t nRuns;
+        memcpy(&nRuns, diff, sizeof(uint64_t));
+
+        size_t pos = sizeof(uint64_t);
+        for (uint64_t i = 0; i < nRuns; i++) {
+            if (pos + 2 * sizeof(uint32_t) > diffSize) {
+                throw std::runtime_error("Memory diff truncated");
+            }
+
+            uint32_t offset;
+            uint32_t length;
+            memcpy(&offset, diff + pos, sizeof(uint32_t));
+            memcpy(&length, diff + pos + sizeof(uint32_t), sizeof(uint32_t));
+            pos += 2 * sizeof(uint32_t);
+
+            if (pos + length > diffSize) {
+                throw std::runtime_error("Memory diff truncated");
+            }
+
+            f(offset, length, diff + pos);
+            pos += length;
+        }
+    }
+
+    size_t getMemoryDiffExtent(const uint8_t *diff, size_t diffSize) {
+        size_t extent = 0;
+        forEachRun(diff, diffSize, [&extent](uint32_t offset, uint32_t length, const uint8_t *) {
+            extent = std::max<size_t>(extent, (size_t) offset + length);
+        });
+
+        return extent;
+    }
+
+    size_t applyMemoryDiff(uint8_t *memBase, size_t memSize, const uint8_t *diff, size_t diffSize) {
+        size_t nBytes = 0;
+        forEachRun(diff, diffSize, [memBase, memSize, &nBytes](uint32_t offset, uint32_t length,
+                                                               const uint8_t *data) {
+            if ((size_t) offset + length > memSize) {
+                throw std::runtime_error("Memory diff outside of memory");
+            }
+
+            memcpy(memBase + offset, data, length);
+            nBytes += length;
+        });
+
+        return nBytes;
+    }
+}
@@ -0,0 +1,435 @@
+#include "serialisation.h"
+
+#include <wasm/WasmModule.h>
+
+#include <faabric/util/logging.h>
+#include <faabric/util/memory.h>
+
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string_view>
+#include <unordered_map>
+
+namespace wasm {
+    static bool isZeroChunk(const uint8_t *chunk) {
+        // Compare word-by-word, most non-zero chunks fail in the first few bytes
+        const auto *words = reinterpret_cast<const uint64_t *>(chunk);
+        for (size_t i = 0; i < SNAPSHOT_CHUNK_SIZE / sizeof(uint64_t); i++) {
+            if (words[i] != 0) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    static size_t hashChunk(const uint8_t *chunk) {
+        std::string_view view(reinterpret_cast<const char *>(chunk), SNAPSHOT_CHUNK_SIZE);
+        return std::hash<std::string_view>{}(view);
+    }
+
+    /**
+     * Adds a record for the given chunk, extending the previous record if it's of the
+     * same type and contiguous.
+     */
+    static void appendChunkRecord(SnapshotPlan &plan, uint64_t chunkIdx, uint32_t type) {
+        if (!plan.records.empty()) {
+            SnapshotRecord &last = plan.records.back();
+            if (last.type == type && last.chunkIdx + last.nChunks == chunkIdx) {
+                last.nChunks++;
+                return;
+            }
+        }
+
+        plan.records.push_back({chunkIdx, 1, type, 0});
+    }
+
+    size_t SnapshotPlan::getSerialisedSize() const {
+        return sizeof(SnapshotHeader) + (records.size() * sizeof(SnapshotRecord)) +
+               (getDataChunkCount() * SNAPSHOT_CHUNK_SIZE);
+    }
+
+    size_t SnapshotPlan::getDataChunkCount() const {
+        size_t count = 0;
+        for (const auto &r : records) {
+            if (r.type == SNAPSHOT_RECORD_DATA) {
+                count += r.nChunks;
+            }
+        }
+
+        return count;
+    }
+
+    MemoryRegionBuf::MemoryRegionBuf(uint8_t *data, size_t size) {
+        char *start = reinterpret_cast<char *>(data);
+        setp(start, start + size);
+        setg(start, start, start + size);
+    }
+
+    size_t MemoryRegionBuf::bytesWritten() const {
+        return pptr() - pbase();
+    }
+
+    SnapshotPlan planMemorySnapshot(const uint8_t *memBase, size_t numPages) {
+        SnapshotPlan plan;
+        plan.numPages = numPages;
+
+        size_t nChunks = (numPages * WASM_BYTES_PER_PAGE) / SNAPSHOT_CHUNK_SIZE;
+
+        // Hash of chunk contents to the first chunk with those contents
+        std::unordered_map<size_t, uint64_t> seenChunks;
+
+        for (uint64_t i = 0; i < nChunks; i++) {
+            const uint8_t *chunk = memBase + (i * SNAPSHOT_CHUNK_SIZE);
+            if (isZeroChunk(chunk)) {
+                continue;
+            }
+
+            size_t hash = hashChunk(chunk);
+
+            // Check for a duplicate, making sure it's not just a hash collision
+            auto it = seenChunks.find(hash);
+            if (it != seenChunks.end()) {
+                const uint8_t *source = memBase + (it->second * SNAPSHOT_CHUNK_SIZE);
+                if (memcmp(source, chunk, SNAPSHOT_CHUNK_SIZE) == 0) {
+                    plan.records.push_back({i, 1, SNAPSHOT_RECORD_DUPLICATE, it->second});
+                    continue;
+                }
+            } else {
+                seenChunks[hash] = i;
+            }
+
+            appendChunkRecord(plan, i, SNAPSHOT_RECORD_DATA);
+        }
+
+        return plan;
+    }
+
+    /**
+     * Plans a delta containing only the chunks changed since the snapshot the image was
+     * taken with. Only chunks within the dirty ranges (i.e. those written since then) are
+     * considered. A dirty chunk is compared with its copy in the image if there is one,
+     * otherwise it's assumed to have changed. The image is then replaced with copies of
+     * just the dirty chunks.
+     */
+    SnapshotPlan planMemorySnapshotDelta(const uint8_t *memBase, size_t numPages,
+                                         const std::vector<std::pair<size_t, size_t>> &dirtyRanges,
+                                         SnapshotImage &image) {
+        SnapshotPlan plan;
+        plan.numPages = numPages;
+        plan.flags = SNAPSHOT_FLAG_DELTA;
+
+        // Memory can only grow, and new memory starts off zeroed, so is only in the delta
+        // if it's been written
+        size_t nChunks = (numPages * WASM_BYTES_PER_PAGE) / SNAPSHOT_CHUNK_SIZE;
+
+        SnapshotImage nextImage;
+        uint64_t nextChunk = 0;
+        for (const auto &r : dirtyRanges) {
+            uint64_t firstChunk = std::max<uint64_t>(r.first / SNAPSHOT_CHUNK_SIZE, nextChunk);
+            uint64_t endChunk = std::min<uint64_t>((r.first + r.second + SNAPSHOT_CHUNK_SIZE - 1) / SNAPSHOT_CHUNK_SIZE,
+                                                   nChunks);
+
+            for (uint64_t i = firstChunk; i < endChunk; i++) {
+                const uint8_t *chunk = memBase + (i * SNAPSHOT_CHUNK_SIZE);
+
+                auto it = image.find(i);
+                bool changed = it == image.end() || memcmp(it->second.data(), chunk, SNAPSHOT_CHUNK_SIZE) != 0;
+
+                std::vector<uint8_t> &copy = nextImage[i];
+                if (it != image.end()) {
+                    copy = std::move(it->second);
+                }
+
+                if (changed) {
+                    copy.assign(chunk, chunk + SNAPSHOT_CHUNK_SIZE);
+                    appendChunkRecord(plan, i, isZeroChunk(chunk) ? SNAPSHOT_RECORD_ZERO : SNAPSHOT_RECORD_DATA);
+                }
+            }
+
+            nextChunk = std::max(nextChunk, endChunk);
+        }
+
+        image = std::move(nextImage);
+
+        return plan;
+    }
+
+    void writeMemorySnapshot(const SnapshotPlan &plan, const uint8_t *memBase, std::ostream &outStream) {
+        SnapshotHeader header{};
+        header.magic = SNAPSHOT_MAGIC;
+        header.version = SNAPSHOT_VERSION;
+        header.flags = plan.flags;
+        header.chunkSize = SNAPSHOT_CHUNK_SIZE;
+        header.stackPointer = plan.stackPointer;
+        header.numPages = plan.numPages;
+        header.numRecords = plan.records.size();
+
+        outStream.write(reinterpret_cast<const char *>(&header), sizeof(SnapshotHeader));
+
+        // Data is written straight from memory after each record
+        for (const auto &r : plan.records) {
+            outStream.write(reinterpret_cast<const char *>(&r), sizeof(SnapshotRecord));
+
+            if (r.type == SNAPSHOT_RECORD_DATA) {
+                const uint8_t *data = memBase + (r.chunkIdx * SNAPSHOT_CHUNK_SIZE);
+                outStream.write(reinterpret_cast<const char *>(data), r.nChunks * SNAPSHOT_CHUNK_SIZE);
+            }
+        }
+
+        if (!outStream) {
+            throw std::runtime_error("Failed writing memory snapshot");
+        }
+    }
+
+    SnapshotHeader readMemorySnapshotHeader(std::istream &inStream) {
+        const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+
+        SnapshotHeader header{};
+        inStream.read(reinterpret_cast<char *>(&header), sizeof(SnapshotHeader));
+
+        if (!inStream || header.magic != SNAPSHOT_MAGIC) {
+            logger->error("Invalid memory snapshot");
+            throw std::runtime_error("Invalid memory snapshot");
+        }
+
+        if (header.version != SNAPSHOT_VERSION || header.chunkSize != SNAPSHOT_CHUNK_SIZE) {
+            logger->error("Unsupported memory snapshot (version {}, chunk size {})", header.version,
+                          header.chunkSize);
+            throw std::runtime_error("Unsupported memory snapshot");
+        }
+
+        if (header.flags & SNAPSHOT_FLAG_COMPRESSED) {
+            logger->error("Compressed memory snapshots not supported");
+            throw std::runtime_error("Compressed memory snapshots not supported");
+        }
+
+        return header;
+    }
+
+    /**
+     * Zeroes the given chunks, skipping those that are already zero to avoid needlessly
+     * touching (and hence copying) pages.
+     */
+    static void zeroChunks(uint8_t *memBase, uint64_t startIdx, uint64_t endIdx) {
+        for (uint64_t i = startIdx; i < endIdx; i++) {
+            uint8_t *chunk = memBase + (i * SNAPSHOT_CHUNK_SIZE);
+            if (!isZeroChunk(chunk)) {
+                memset(chunk, 0, SNAPSHOT_CHUNK_SIZE);
+            }
+        }
+    }
+
+    /**
+     * Memory must already be the size given in the header. Anything not covered by a
+     * record is zero in a full snapshot, or unchanged in a delta.
+     */
+    void readMemorySnapshot(const SnapshotHeader &header, std::istream &inStream, uint8_t *memBase) {
+        uint64_t nChunks = (header.numPages * WASM_BYTES_PER_PAGE) / SNAPSHOT_CHUNK_SIZE;
+        uint64_t nextChunk = 0;
+        bool isDelta = header.flags & SNAPSHOT_FLAG_DELTA;
+
+        SnapshotRecord r{};
+        for (uint64_t i = 0; i < header.numRecords; i++) {
+            inStream.read(reinterpret_cast<char *>(&r), sizeof(SnapshotRecord));
+            if (!inStream || r.chunkIdx < nextChunk || r.chunkIdx + r.nChunks > nChunks) {
+                throw std::runtime_error("Invalid memory snapshot record");
+            }
+
+            if (!isDelta) {
+                zeroChunks(memBase, nextChunk, r.chunkIdx);
+            }
+
+            uint8_t *dest = memBase + (r.chunkIdx * SNAPSHOT_CHUNK_SIZE);
+            if (r.type == SNAPSHOT_RECORD_DATA) {
+                inStream.read(reinterpret_cast<char *>(dest), r.nChunks * SNAPSHOT_CHUNK_SIZE);
+                if (!inStream) {
+                    throw std::runtime_error("Truncated memory snapshot");
+                }
+            } else if (r.type == SNAPSHOT_RECORD_DUPLICATE && r.nChunks == 1 && r.sourceChunkIdx < r.chunkIdx) {
+                memcpy(dest, memBase + (r.sourceChunkIdx * SNAPSHOT_CHUNK_SIZE), SNAPSHOT_CHUNK_SIZE);
+            } else if (r.type == SNAPSHOT_RECORD_ZERO) {
+                zeroChunks(memBase, r.chunkIdx, r.chunkIdx + r.nChunks);
+            } else {
+                throw std::runtime_error("Invalid memory snapshot record");
+            }
+
+            nextChunk = r.chunkIdx + r.nChunks;
+        }
+
+        if (!isDelta) {
+            zeroChunks(memBase, nextChunk, nChunks);
+        }
+    }
+
+    void writeMappableSnapshot(int fd, const uint8_t *memBase, size_t numPages) {
+        const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+
+        MappableSnapshotHeader header{};
+        header.magic = MAPPABLE_SNAPSHOT_MAGIC;
+        header.version = MAPPABLE_SNAPSHOT_VERSION;
+        header.flags = 0;
+        header.numPages = numPages;
+        header.dataOffset = faabric::util::HOST_PAGE_SIZE;
+
+        size_t memSize = numPages * WASM_BYTES_PER_PAGE;
+
+        // Size the file up front so that unwritten chunks are holes
+        if (ftruncate(fd, header.dataOffset + memSize) != 0) {
+            logger->error("Failed to size mappable snapshot: {}", strerror(errno));
+            throw std::runtime_error("Failed to size mappable snapshot");
+        }
+
+        if (pwrite(fd, &header, sizeof(MappableSnapshotHeader), 0) != sizeof(MappableSnapshotHeader)) {
+            logger->error("Failed to write mappable snapshot header: {}", strerror(errno));
+            throw std::runtime_error("Failed to write mappable snapshot");
+        }
+
+        // Write each run of non-zero chunks
+        size_t nChunks = memSize / SNAPSHOT_CHUNK_SIZE;
+        size_t chunkIdx = 0;
+        while (chunkIdx < nChunks) {
+            if (isZeroChunk(memBase + (chunkIdx * SNAPSHOT_CHUNK_SIZE))) {
+                chunkIdx++;
+                continue;
+            }
+
+            size_t runStart = chunkIdx;
+            while (chunkIdx < nChunks && !isZeroChunk(memBase + (chunkIdx * SNAPSHOT_CHUNK_SIZE))) {
+                chunkIdx++;
+            }
+
+            size_t offset = runStart * SNAPSHOT_CHUNK_SIZE;
+            size_t remaining = (chunkIdx - runStart) * SNAPSHOT_CHUNK_SIZE;
+            while (remaining > 0) {
+                ssize_t written = pwrite(fd, memBase + offset, remaining, header.dataOffset + offset);
+                if (written <= 0) {
+                    logger->error("Failed to write mappable snapshot: {}", strerror(errno));
+                    throw std::runtime_error("Failed to write mappable snapshot");
+                }
+
+                offset += written;
+                remaining -= written;
+            }
+        }
+    }
+
+    /**
+     * Mapping past the end of a file gives SIGBUS when the pages are touched, so a
+     * truncated snapshot must be caught before it's mapped
+     */
+    static void checkMappableSnapshotSize(int fd, const MappableSnapshotHeader &header) {
+        struct stat fileStat{};
+        if (fstat(fd, &fileStat) != 0) {
+            faabric::util::getLogger()->error("Failed to stat mappable snapshot: {}", strerror(errno));
+            throw std::runtime_error("Failed to stat mappable snapshot");
+        }
+
+        size_t requiredSize = header.dataOffset + ((size_t) header.numPages * WASM_BYTES_PER_PAGE);
+        if ((size_t) fileStat.st_size < requiredSize) {
+            faabric::util::getLogger()->error("Mappable snapshot truncated ({} < {} bytes)", fileStat.st_size,
+                                              requiredSize);
+            throw std::runtime_error("Truncated mappable snapshot");
+        }
+    }
+
+    /**
+     * Returns false if the file isn't a mappable snapshot
+     */
+    bool readMappableSnapshotHeader(int fd, MappableSnapshotHeader &header) {
+        ssize_t nRead = pread(fd, &header, sizeof(MappableSnapshotHeader), 0);
+        if (nRead != sizeof(MappableSnapshotHeader) || header.magic != MAPPABLE_SNAPSHOT_MAGIC) {
+            return false;
+        }
+
+        if (header.version != MAPPABLE_SNAPSHOT_VERSION ||
+            header.dataOffset % faabric::util::HOST_PAGE_SIZE != 0) {
+            throw std::runtime_error("Unsupported mappable snapshot");
+        }
+
+        checkMappableSnapshotSize(fd, header);
+
+        return true;
+    }
+
+    /**
+     * Maps the snapshot copy-on-write over the given memory, so pages are only loaded
+     * when touched. Memory must already be at least the size given in the header. The
+     * file must not be modified while the mapping is in use.
+     */
+    void mapMappableSnapshot(int fd, const MappableSnapshotHeader &header, uint8_t *memBase) {
+        size_t memSize = header.numPages * WASM_BYTES_PER_PAGE;
+        if (memSize == 0) {
+            return;
+        }
+
+        checkMappableSnapshotSize(fd, header);
+
+        void *res = mmap(memBase, memSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+                         header.dataOffset);
+        if (res == MAP_FAILED) {
+            const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+            logger->error("Failed to map snapshot: {}", strerror(errno));
+            throw std::runtime_error("Failed to map snapshot");
+        }
+    }
+
+    static void checkSnapshotBaseKey(const std::string &baseKey) {
+        if (baseKey.find(SNAPSHOT_KEY_SEPARATOR) != std::string::npos) {
+            const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+            logger->error("Snapshot key {} contains reserved separator {}", baseKey, SNAPSHOT_KEY_SEPARATOR);
+            throw std::runtime_error("Snapshot key contains reserved separator");
+        }
+    }
+
+    std::string getVersionedSnapshotKey(const std::string &baseKey, int version) {
+        checkSnapshotBaseKey(baseKey);
+
+        if (version == 0) {
+            return baseKey;
+        }
+
+        return baseKey + SNAPSHOT_KEY_SEPARATOR + "v" + std::to_string(version);
+    }
+
+    std::string getSnapshotDeltaKey(const std::string &baseKey, int version) {
+        checkSnapshotBaseKey(baseKey);
+
+        return baseKey + SNAPSHOT_KEY_SEPARATOR + "delta" + std::to_string(version);
+    }
+
+    /**
+     * Splits a key of the form <base>#v<version>. As the separator can't appear in base
+     * keys, anything without it (e.g. a user's own key ending in _v2) is left alone.
+     */
+    bool parseVersionedSnapshotKey(const std::string &key, std::string &baseKey, int &version) {
+        size_t pos = key.find(SNAPSHOT_KEY_SEPARATOR);
+        if (pos == std::string::npos) {
+            return false;
+        }
+
+        if (pos == 0 || pos + 2 >= key.size() || key[pos + 1] != 'v') {
+            throw std::runtime_error("Invalid versioned snapshot key");
+        }
+
+        std::string versionStr = key.substr(pos + 2);
+        if (versionStr.find_first_not_of("0123456789") != std::string::npos) {
+            throw std::runtime_error("Invalid versioned snapshot key");
+        }
+
+        version = std::stoi(versionStr);
+        if (version <= 0) {
+            throw std::runtime_error("Invalid versioned snapshot key");
+        }
+
+        baseKey = key.substr(0, pos);
+        return true;
+    }
+
+    std::string getThreadMemoryDiffKey(const std::string &snapshotKey, unsigned int callId) {
+        return snapshotKey + "_diff_" + std::to_string(callId);
+    }
+}
@@ -42,12 +42,13 @@ namespace wasm {
             }
         }
 
-        PlatformThreadPool::PlatformThreadPool(size_t numThreads, WAVMWasmModule *module) {
+        PlatformThreadPool::PlatformThreadPool(size_t numThreads, WAVMWasmModule *module) : module(module) {
             for (size_t i = 0; i < numThreads; ++i) {
                 // Set up workers arguments including pre-allocating a stack for the threads it will execute
                 WorkerArgs *workerArgs = new WorkerArgs();
                 workerArgs->stackTop = module->allocateThreadStack();
                 workerArgs->pool = this;
+                stacks.emplace_back(workerArgs->stackTop);
 
                 // Run worker
                 workers.emplace_back(Platform::createThread(0, workerEntryFunc, workerArgs));
@@ -78,6 +79,11 @@ namespace wasm {
             for (auto worker : workers) {
                 Platform::joinThread(worker);
             }
+
+            // Workers are done with their stacks, so they can go back to the module
+            for (auto stack : stacks) {
+                module->releaseThreadStack(stack);
+            }
         }
     }
 }
@@ -1,10 +1,13 @@
 #include "WAVMWasmModule.h"
 
+#include <algorithm>
+#include <atomic>
 #include <boost/filesystem.hpp>
-#include <cereal/archives/binary.hpp>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
+#include <conf/FaasmConfig.h>
 #include <ir_cache/IRModuleCache.h>
 #include <storage/SharedFiles.h>
 #include <faabric/util/bytes.h>
@@ -13,6 +16,7 @@
 #include <faabric/util/timing.h>
 #include <faabric/util/config.h>
 #include <faabric/util/locks.h>
+#include <wasm/memory_util.h>
 #include <wasm/serialisation.h>
 
 #include <WAVM/WASM/WASM.h>
@@ -27,7 +31,11 @@
 #include <wavm/openmp/ThreadState.h>
 #include <wavm/OMPThreadPool.h>
 
-constexpr int THREAD_STACK_SIZE(2 * ONE_MB_BYTES);
+// Holes in a zygote's fd smaller than this are mapped anyway, to limit the number of mappings
+static const size_t MIN_UNMAPPED_HOLE_SIZE = 64 * faabric::util::HOST_PAGE_SIZE;
+
+// Upper limit on the pages reserved ahead of mmap/brk on each growth (64MB)
+static const WAVM::Uptr MAX_MEMORY_RESERVE_PAGES = 1024;
 
 using namespace WAVM;
 
@@ -37,6 +45,8 @@ namespace wasm {
     static Runtime::Instance *baseEnvModule = nullptr;
     static Runtime::Instance *baseWasiModule = nullptr;
 
+    static std::atomic<uint64_t> memoryFdCounter(0);
+
     std::mutex baseModuleMx;
 
     static void instantiateBaseModules() {
@@ -127,6 +137,18 @@ namespace wasm {
 
         memoryFd = other.memoryFd;
         memoryFdSize = other.memoryFdSize;
+        memoryFdGeneration = other.memoryFdGeneration;
+
+        freeMemoryRanges = other.freeMemoryRanges;
+        unmappedFromFd = false;
+        initialMemoryPages = other.initialMemoryPages;
+        memoryBreakPages = other.memoryBreakPages;
+        memoryReservedPages = other.memoryReservedPages;
+
+        threadStackSize = other.threadStackSize;
+        threadStackGuard = other.threadStackGuard;
+        hugePages = other.hugePages;
+        freeThreadStacks = other.freeThreadStacks;
 
         _isBound = other._isBound;
         boundUser = other.boundUser;
@@ -141,6 +163,9 @@ namespace wasm {
         stdoutMemFd = 0;
         stdoutSize = 0;
 
+        // Incremental snapshots belong to the original
+        resetIncrementalSnapshot();
+
         if (other._isBound) {
             if (memoryFd > 0) {
                 // Clone compartment excluding memory
@@ -161,6 +186,7 @@ namespace wasm {
             // Extract the memory and table again
             defaultMemory = Runtime::getDefaultMemory(moduleInstance);
             defaultTable = Runtime::getDefaultTable(moduleInstance);
+            adviseHugePages(0, getMaxMemoryBytes());
 
             // Map memory contents if necessary
             if (memoryFd > 0) {
@@ -174,6 +200,13 @@ namespace wasm {
             // Remap dynamic modules
             // TODO - double check this works
             dynamicPathToHandleMap = other.dynamicPathToHandleMap;
+            dynamicExportIndex = other.dynamicExportIndex;
+            functionTableSlots = other.functionTableSlots;
+            freeTableSlots = other.freeTableSlots;
+            pinnedTableSlots = other.pinnedTableSlots;
+            dynamicModuleSymbolSlots = other.dynamicModuleSymbolSlots;
+            dynamicModuleOpenCounts = other.dynamicModuleOpenCounts;
+            dynamicLinkChanges = other.dynamicLinkChanges;
             for (auto &p : other.dynamicModuleMap) {
                 Runtime::Instance *newInstance = Runtime::remapToClonedCompartment(p.second, compartment);
                 dynamicModuleMap[p.first] = newInstance;
@@ -196,6 +229,10 @@ namespace wasm {
         const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
 
         // --- Faasm stuff ---
+
+        // Joining the OpenMP workers returns their stacks, so do it before clearing the pool
+        OMPPool.reset();
+
         sharedMemWasmPtrs.clear();
 
         globalOffsetTableMap.clear();
@@ -207,6 +244,18 @@ namespace wasm {
             dynamicModuleMap[m.first] = nullptr;
         }
         dynamicModuleMap.clear();
+        dynamicExportIndex.reset();
+        functionTableSlots.clear();
+        freeTableSlots.clear();
+        pinnedTableSlots.clear();
+        dynamicModuleSymbolSlots.clear();
+        dynamicModuleOpenCounts.clear();
+
+        freeMemoryRanges.clear();
+        unmappedFromFd = false;
+        initialMemoryPages = 0;
+        resetMemoryBreak();
+        freeThreadStacks.clear();
 
         // --- WAVM stuff ---
 
@@ -371,6 +420,13 @@ namespace wasm {
         boundUser = msg.user();
         boundFunction = msg.function();
 
+        // Stacks are whole wasm pages, as they're mmapped
+        conf::FaasmConfig &conf = conf::getFaasmConfig();
+        U32 stackBytes = (U32) conf.getThreadStackKb(boundUser, boundFunction) * 1024;
+        threadStackSize = std::max<U32>(getNumberOfWasmPagesForBytes(stackBytes), 1) * WASM_BYTES_PER_PAGE;
+        threadStackGuard = conf.threadStackGuard == "on";
+        hugePages = conf.useHugePages(boundUser, boundFunction);
+
         // Set up the compartment and context
         PROF_START(wasmContext)
         compartment = Runtime::createCompartment();
@@ -385,6 +441,10 @@ namespace wasm {
         // Keep reference to memory and table
         defaultMemory = Runtime::getDefaultMemory(moduleInstance);
         defaultTable = Runtime::getDefaultTable(moduleInstance);
+        adviseHugePages(0, getMaxMemoryBytes());
+
+        // Anything below this is the module's own data, stack and heap
+        initialMemoryPages = Runtime::getMemoryNumPages(defaultMemory);
 
         // Prepare the filesystem
         filesystem.prepareFilesystem();
@@ -412,8 +472,7 @@ namespace wasm {
             }
 
             Uptr initialTableSize = Runtime::getTableNumElements(defaultTable);
-            Uptr initialMemorySize = Runtime::getMemoryNumPages(defaultMemory) * WASM_BYTES_PER_PAGE;
-            Uptr initialMemoryPages = Runtime::getMemoryNumPages(defaultMemory);
+            Uptr initialMemorySize = initialMemoryPages * WASM_BYTES_PER_PAGE;
 
             logger->debug("heap_top={} initial_pages={} initial_table={}", initialMemorySize, initialMemoryPages,
                           initialTableSize);
@@ -557,6 +616,7 @@ namespace wasm {
                 // Put the actual function into the placeholder table location
                 logger->debug("Filling gap in GOT for function: {} at {}", e.first, e.second);
                 Runtime::setTableElement(defaultTable, e.second, missingFunction);
+                functionTableSlots.emplace(missingFunction, e.second);
 
                 // Add this function to the GOT
                 globalOffsetTableMap.insert({e.first, e.second});
@@ -591,7 +651,9 @@ namespace wasm {
         // Return the handle if we've already loaded this module
         if (dynamicPathToHandleMap.count(path) > 0) {
             logger->debug("Reusing dynamic module {}", path);
-            return dynamicPathToHandleMap[path];
+            int handle = dynamicPathToHandleMap[path];
+            dynamicModuleOpenCounts[handle]++;
+            return handle;
         }
 
         // Note, must start handles at 2, otherwise dlopen can see it as an error
@@ -607,13 +669,47 @@ namespace wasm {
         // Keep a record of this module
         dynamicPathToHandleMap[path] = nextHandle;
         dynamicModuleMap[nextHandle] = mod;
+        dynamicModuleOpenCounts[nextHandle] = 1;
         dynamicModuleCount++;
 
+        IRModuleCache &moduleRegistry = wasm::getIRModuleCache();
+        addToDynamicExportIndex(nextHandle, moduleRegistry.getModule(boundUser, boundFunction, path));
+
         logger->debug("Loaded shared module at {} with handle {}", path, nextHandle);
 
         return nextHandle;
     }
 
+    /**
+     * Lets imports be resolved against all the loaded dynamic modules with a single
+     * lookup rather than checking each module in turn. Where modules export the same
+     * name, the first one loaded wins.
+     */
+    void WAVMWasmModule::addToDynamicExportIndex(int handle, const IR::Module &irModule) {
+        if (!dynamicExportIndex) {
+            dynamicExportIndex = std::make_shared<std::unordered_map<std::string, int>>();
+        } else if (dynamicExportIndex.use_count() > 1) {
+            dynamicExportIndex = std::make_shared<std::unordered_map<std::string, int>>(*dynamicExportIndex);
+        }
+
+        for (const auto &e : irModule.exports) {
+            dynamicExportIndex->emplace(e.name, handle);
+        }
+    }
+
+    Runtime::Object *WAVMWasmModule::getDynamicModuleExport(const std::string &name) {
+        if (!dynamicExportIndex) {
+            return nullptr;
+        }
+
+        auto it = dynamicExportIndex->find(name);
+        if (it == dynamicExportIndex->end()) {
+            return nullptr;
+        }
+
+        return getInstanceExport(dynamicModuleMap[it->second], name);
+    }
+
     uint32_t WAVMWasmModule::getDynamicModuleFunction(int handle, const std::string &funcName) {
         const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
 
@@ -632,16 +728,90 @@ namespace wasm {
             throw std::runtime_error("Missing dynamic module function");
         }
 
+        // The function may already be in the table from the module's own elements
+        auto gotIt = globalOffsetTableMap.find(funcName);
+        if (gotIt != globalOffsetTableMap.end() &&
+            Runtime::getTableElement(defaultTable, gotIt->second) == exportedFunc) {
+            logger->debug("Resolved function {} to existing index {}", funcName, gotIt->second);
+            return gotIt->second;
+        }
+
         Uptr tableIdx = addFunctionToTable(exportedFunc);
 
+        // Slots shared with a GOT entry are pinned, so don't need tracking here
+        if (pinnedTableSlots.count(tableIdx) == 0) {
+            dynamicModuleSymbolSlots[handle].insert(tableIdx);
+        }
+
         logger->debug("Resolved function {} to index {}", funcName, tableIdx);
         return tableIdx;
     }
 
+    /**
+     * Equivalent of dlclose. Modules can't be unloaded from the compartment, so stay
+     * loaded (and a later dlopen gets the same handle), but once every dlopen of a
+     * module has been closed, the table slots handed out by dlsym on it are cleared
+     * and made available for reuse.
+     */
+    bool WAVMWasmModule::dynamicUnloadModule(int handle) {
+        const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+
+        auto it = dynamicModuleOpenCounts.find(handle);
+        if (it == dynamicModuleOpenCounts.end() || it->second <= 0) {
+            logger->error("dlclose of dynamic module not open: {}", handle);
+            return false;
+        }
+
+        if (--it->second > 0) {
+            return true;
+        }
+
+        dynamicLinkChanges++;
+        std::unordered_set<Uptr> &slots = dynamicModuleSymbolSlots[handle];
+        for (Uptr slot : slots) {
+            if (pinnedTableSlots.count(slot) > 0) {
+                continue;
+            }
+
+            functionTableSlots.erase(Runtime::getTableElement(defaultTable, slot));
+            Runtime::setTableElement(defaultTable, slot, nullptr);
+            freeTableSlots.push_back(slot);
+        }
+
+        logger->debug("Freed {} table slots for dynamic module {}", slots.size(), handle);
+        dynamicModuleSymbolSlots.erase(handle);
+
+        return true;
+    }
+
+    /**
+     * Adds the function to the table, unless it's already been added, in which case its
+     * existing slot is returned. Slots freed by dlclose are reused before growing.
+     */
     uint32_t WAVMWasmModule::addFunctionToTable(Runtime::Object *exportedFunc) {
+        auto it = functionTableSlots.find(exportedFunc);
+        if (it != functionTableSlots.end()) {
+            return it->second;
+        }
+
+        Uptr tableIdx = allocateTableSlot();
+        Runtime::setTableElement(defaultTable, tableIdx, exportedFunc);
+        functionTableSlots[exportedFunc] = tableIdx;
+
+        return tableIdx;
+    }
+
+    Uptr WAVMWasmModule::allocateTableSlot() {
         const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
 
-        // Add function to the table
+        dynamicLinkChanges++;
+
+        if (!freeTableSlots.empty()) {
+            Uptr tableIdx = freeTableSlots.back();
+            freeTableSlots.pop_back();
+            return tableIdx;
+        }
+
         Uptr prevIdx;
         Runtime::GrowResult result = Runtime::growTable(defaultTable, 1, &prevIdx);
         if (result != Runtime::GrowResult::success) {
@@ -652,7 +822,6 @@ namespace wasm {
         Uptr newElements = Runtime::getTableNumElements(defaultTable);
         logger->debug("Table grown from {} elements to {}", prevIdx, newElements);
 
-        Runtime::setTableElement(defaultTable, prevIdx, exportedFunc);
         return prevIdx;
     }
 
@@ -794,11 +963,13 @@ namespace wasm {
                 getContextRuntimeData(executionContext),
                 funcInstance,
                 invokeArgs.data(),
-                getExecutingWAVMModule()->allocateThreadStack(),
+                allocateThreadStack(),
         };
 
         // Record the return value
         msg.set_returnvalue(executeThreadLocally(spec));
+
+        releaseThreadStack(spec.stackTop);
     }
 
     U32 WAVMWasmModule::mmapFile(U32 fd, U32 length) {
@@ -823,25 +994,293 @@ namespace wasm {
         return wasmPtr;
     }
 
+    /**
+     * Hands out a stack from the pool, only mapping a new one if none are free. Threads
+     * may start and finish concurrently, and a new stack comes out of the same memory as
+     * the guest's own mmaps, hence the memory lock.
+     *
+     * If configured, the lowest host page of the stack is made read-only while it's in
+     * use, so a thread overflowing its stack traps rather than silently writing over
+     * whatever is below. It's left readable so that snapshots can still be taken.
+     */
     U32 WAVMWasmModule::allocateThreadStack() {
-        return this->mmapMemory(THREAD_STACK_SIZE);
+        faabric::util::UniqueLock lock(memoryMx);
+
+        U32 stackBase;
+        if (!freeThreadStacks.empty()) {
+            stackBase = freeThreadStacks.back();
+            freeThreadStacks.pop_back();
+        } else {
+            stackBase = doMmapMemory(threadStackSize);
+        }
+
+        if (threadStackGuard) {
+            U8 *guardPtr = Runtime::getMemoryBaseAddress(defaultMemory) + stackBase;
+            if (mprotect(guardPtr, faabric::util::HOST_PAGE_SIZE, PROT_READ) != 0) {
+                faabric::util::getLogger()->error("Failed to guard thread stack at {} ({} - {})", stackBase, errno,
+                                                  strerror(errno));
+                throw std::runtime_error("Failed to guard thread stack");
+            }
+        }
+
+        return stackBase;
+    }
+
+    void WAVMWasmModule::releaseThreadStack(U32 stackBase) {
+        faabric::util::UniqueLock lock(memoryMx);
+
+        // Lift the guard so it can't outlive the pool (e.g. once memory is reset)
+        if (threadStackGuard) {
+            U8 *guardPtr = Runtime::getMemoryBaseAddress(defaultMemory) + stackBase;
+            mprotect(guardPtr, faabric::util::HOST_PAGE_SIZE, PROT_READ | PROT_WRITE);
+        }
+
+        freeThreadStacks.emplace_back(stackBase);
+    }
+
+    U32 WAVMWasmModule::getThreadStackSize() {
+        return threadStackSize;
+    }
+
+    size_t WAVMWasmModule::getFreeThreadStackCount() {
+        faabric::util::UniqueLock lock(memoryMx);
+        return freeThreadStacks.size();
     }
 
     U32 WAVMWasmModule::mmapMemory(U32 length) {
+        faabric::util::UniqueLock lock(memoryMx);
+        return doMmapMemory(length);
+    }
+
+    /**
+     * Guest threads allocate concurrently, so anything touching the free list, the break
+     * or the size of memory must hold the memory lock. This and the other internals below
+     * expect the caller to hold it already.
+     */
+    U32 WAVMWasmModule::doMmapMemory(U32 length) {
         // Round up to page boundary
         Uptr nWasmPages = getNumberOfWasmPagesForBytes(length);
-        return mmapPages(nWasmPages);
+
+        // Reuse unmapped memory where possible rather than growing
+        U32 offset;
+        if (takeFreeMemoryRange(nWasmPages * WASM_BYTES_PER_PAGE, offset)) {
+            faabric::util::getLogger()->debug("mmap - Reusing {} pages at {}", nWasmPages, offset);
+            return offset;
+        }
+
+        return doMmapPages(nWasmPages);
+    }
+
+    /**
+     * Takes the smallest free range that fits, leaving the rest of it free.
+     */
+    bool WAVMWasmModule::takeFreeMemoryRange(U32 length, U32 &offset) {
+        auto best = freeMemoryRanges.end();
+        for (auto it = freeMemoryRanges.begin(); it != freeMemoryRanges.end(); ++it) {
+            if (it->second >= length && (best == freeMemoryRanges.end() || it->second < best->second)) {
+                best = it;
+            }
+        }
+
+        if (best == freeMemoryRanges.end()) {
+            return false;
+        }
+
+        offset = best->first;
+        U32 remaining = best->second - length;
+        freeMemoryRanges.erase(best);
+
+        if (remaining > 0) {
+            freeMemoryRanges[offset + length] = remaining;
+        }
+
+        return true;
+    }
+
+    /**
+     * Memory can't be returned to WAVM, so unmapped ranges are kept for reuse by later
+     * mmaps, merged with any neighbouring free ranges. The range is replaced with fresh
+     * anonymous memory, which releases the physical pages and means it reads as zero
+     * when reused. Just discarding the pages wouldn't do for memory mapped from a
+     * zygote's fd (or mapped from a file), as it would read back as the fd's contents.
+     *
+     * Memory the module started with (data, stack and initial heap) was never mapped,
+     * so can't be unmapped either.
+     */
+    int WAVMWasmModule::munmapMemory(U32 offset, U32 length) {
+        const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+        faabric::util::UniqueLock lock(memoryMx);
+
+        // Memory reserved past the break hasn't been handed out yet
+        syncMemoryBreak();
+        Uptr memSize = Runtime::getMemoryNumPages(defaultMemory) * WASM_BYTES_PER_PAGE;
+        Uptr breakSize = memoryBreakPages * WASM_BYTES_PER_PAGE;
+        Uptr reservedSize = memoryReservedPages * WASM_BYTES_PER_PAGE;
+        Uptr initialSize = initialMemoryPages * WASM_BYTES_PER_PAGE;
+        Uptr alignedLength = getNumberOfWasmPagesForBytes(length) * WASM_BYTES_PER_PAGE;
+        if (offset % WASM_BYTES_PER_PAGE != 0 || length == 0 || offset < initialSize ||
+            offset + alignedLength > memSize ||
+            (offset + alignedLength > breakSize && offset < reservedSize)) {
+            logger->warn("Invalid munmap of {} bytes at {}", length, offset);
+            return -EINVAL;
+        }
+
+        U8 *memoryBase = Runtime::getMemoryBaseAddress(defaultMemory);
+        void *res = mmap(memoryBase + offset, alignedLength, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if (res == MAP_FAILED) {
+            logger->error("Failed to release memory at {} ({} - {})", offset, errno, strerror(errno));
+            throw std::runtime_error("Failed to release unmapped memory");
+        }
+
+        // The new mapping doesn't inherit any advice
+        adviseHugePages(offset, alignedLength);
+
+        // Unmapped pages now read as zeroes
+        incrementalSnapshotTracker.markDirty({offset, alignedLength});
+
+        if (memoryFd > 0 && offset < memoryFdSize) {
+            unmappedFromFd = true;
+        }
+
+        addFreeMemoryRange(offset, alignedLength);
+
+        logger->debug("munmap - Freed {} bytes at {}", alignedLength, offset);
+
+        return 0;
     }
 
+    /**
+     * Adds a range to the free list, merged with any free ranges it touches or overlaps.
+     * The range must read as zero.
+     */
+    void WAVMWasmModule::addFreeMemoryRange(U32 offset, U32 length) {
+        Uptr start = offset;
+        Uptr end = (Uptr) offset + length;
+        auto it = freeMemoryRanges.lower_bound(offset);
+        if (it != freeMemoryRanges.begin()) {
+            auto prev = std::prev(it);
+            if ((Uptr) prev->first + prev->second >= start) {
+                start = prev->first;
+                end = std::max<Uptr>(end, (Uptr) prev->first + prev->second);
+                freeMemoryRanges.erase(prev);
+            }
+        }
+
+        while (it != freeMemoryRanges.end() && it->first <= end) {
+            end = std::max<Uptr>(end, (Uptr) it->first + it->second);
+            it = freeMemoryRanges.erase(it);
+        }
+
+        freeMemoryRanges[(U32) start] = (U32) (end - start);
+    }
+
+    /**
+     * Lets allocators in the guest hand memory back to the host. Discarded pages mapped
+     * from a zygote's fd revert to the zygote's contents, and anywhere else to zeroes,
+     * as with the equivalent host mappings. Only whole host pages within the range are
+     * discarded, so nothing either side of it is lost. Other advice is ignored.
+     */
+    int WAVMWasmModule::adviseMemory(U32 offset, U32 length, int advice) {
+        if (advice != MADV_DONTNEED && advice != MADV_FREE) {
+            return 0;
+        }
+
+        // Memory mustn't grow or be remapped underneath the madvise
+        faabric::util::UniqueLock lock(memoryMx);
+        Uptr memSize = Runtime::getMemoryNumPages(defaultMemory) * WASM_BYTES_PER_PAGE;
+        Uptr end = (Uptr) offset + length;
+        if (end > memSize) {
+            return -EINVAL;
+        }
+
+        Uptr pageSize = faabric::util::HOST_PAGE_SIZE;
+        Uptr alignedStart = (offset + pageSize - 1) & ~(pageSize - 1);
+        Uptr alignedEnd = end & ~(pageSize - 1);
+        if (alignedEnd <= alignedStart) {
+            return 0;
+        }
+
+        // MADV_FREE only applies to anonymous memory, so both get the same treatment
+        U8 *memoryBase = Runtime::getMemoryBaseAddress(defaultMemory);
+        if (madvise(memoryBase + alignedStart, alignedEnd - alignedStart, MADV_DONTNEED) != 0) {
+            return -errno;
+        }
+
+        // Discarded pages have no soft-dirty bits left to show they've changed
+        incrementalSnapshotTracker.markDirty({alignedStart, alignedEnd - alignedStart});
+
+        return 0;
+    }
+
+    size_t WAVMWasmModule::getFreeMemoryBytes() {
+        faabric::util::UniqueLock lock(memoryMx);
+        size_t total = 0;
+        for (auto &r : freeMemoryRanges) {
+            total += r.second;
+        }
+
+        return total;
+    }
+
+    /**
+     * Hands out pages from the end of memory. Growing memory means a trip through the
+     * runtime and committing the new pages, so if configured, memory is grown by a
+     * fraction of its current size on top of what's needed. Later calls are then served
+     * from that reserve without growing. The reserved pages are only committed, not
+     * touched, so they cost nothing physical until they're used.
+     *
+     * The break (i.e. the end of the pages handed out) is tracked separately from the
+     * size of memory, so brk still sees exactly what's been allocated.
+     */
     U32 WAVMWasmModule::mmapPages(U32 pages) {
+        faabric::util::UniqueLock lock(memoryMx);
+        return doMmapPages(pages);
+    }
+
+    U32 WAVMWasmModule::doMmapPages(U32 pages) {
         const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
-        U64 maxSize = getMemoryType(defaultMemory).size.max;
-        Uptr currentPageCount = Runtime::getMemoryNumPages(defaultMemory);
 
         if (pages == 0) {
             throw std::runtime_error("Requesting mapping of zero pages");
         }
 
+        syncMemoryBreak();
+
+        U32 mappedRangePtr = (U32) (memoryBreakPages * WASM_BYTES_PER_PAGE);
+        Uptr reservedPages = memoryReservedPages - memoryBreakPages;
+        if (pages > reservedPages) {
+            Uptr neededPages = pages - reservedPages;
+
+            U64 maxSize = getMemoryType(defaultMemory).size.max;
+            Uptr reservePages = (memoryReservedPages * conf::getFaasmConfig().memoryReservePercent) / 100;
+            reservePages = std::min<Uptr>(reservePages, MAX_MEMORY_RESERVE_PAGES);
+            if (memoryReservedPages + neededPages + reservePages > maxSize) {
+                // Don't let the reserve be what takes memory over the max
+                Uptr headroom = maxSize > memoryReservedPages + neededPages ?
+                                maxSize - memoryReservedPages - neededPages : 0;
+                reservePages = std::min<Uptr>(reservePages, headroom);
+            }
+
+            growMemoryPages(neededPages + reservePages);
+            memoryReservedPages += neededPages + reservePages;
+        } else {
+            logger->debug("mmap - Taking {} reserved pages at {}", pages, mappedRangePtr);
+        }
+
+        memoryBreakPages += pages;
+
+        return mappedRangePtr;
+    }
+
+    /**
+     * Grows memory by exactly the given number of pages, returning the previous size
+     */
+    Uptr WAVMWasmModule::growMemoryPages(Uptr pages) {
+        const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+        U64 maxSize = getMemoryType(defaultMemory).size.max;
+        Uptr currentPageCount = Runtime::getMemoryNumPages(defaultMemory);
+
         Uptr newPageCount = currentPageCount + pages;
         if (newPageCount > maxSize) {
             logger->error("mmap would exceed max of {} pages (growing by {} from {})", maxSize, pages,
@@ -871,10 +1310,84 @@ namespace wasm {
 
         logger->debug("mmap - Growing memory from {} to {} pages", currentPageCount, newPageCount);
 
-        // Get pointer to mapped range
-        auto mappedRangePtr = (U32) (Uptr(pageCountOut) * WASM_BYTES_PER_PAGE);
+        return pageCountOut;
+    }
 
-        return mappedRangePtr;
+    /**
+     * Memory may have been grown other than through mmapPages (e.g. by memory.grow in the
+     * guest, or restoring a snapshot), in which case the break moves to the new end of
+     * memory. Anything still reserved below that is added to the free list.
+     */
+    void WAVMWasmModule::syncMemoryBreak() {
+        Uptr numPages = Runtime::getMemoryNumPages(defaultMemory);
+        if (numPages == memoryReservedPages) {
+            return;
+        }
+
+        if (memoryReservedPages > memoryBreakPages) {
+            addFreeMemoryRange((U32) (memoryBreakPages * WASM_BYTES_PER_PAGE),
+                               (U32) ((memoryReservedPages - memoryBreakPages) * WASM_BYTES_PER_PAGE));
+        }
+
+        memoryBreakPages = numPages;
+        memoryReservedPages = numPages;
+    }
+
+    /**
+     * Drops any reservation without freeing it, for when memory has been overwritten
+     * wholesale (e.g. restoring a snapshot). The break is then the end of memory.
+     */
+    void WAVMWasmModule::resetMemoryBreak() {
+        memoryBreakPages = 0;
+        memoryReservedPages = 0;
+    }
+
+    /**
+     * Forgets all free memory (i.e. reserved pages, unmapped ranges and spare thread
+     * stacks), for when memory is overwritten wholesale by a snapshot which knows
+     * nothing about them.
+     */
+    void WAVMWasmModule::resetFreeMemory() {
+        freeMemoryRanges.clear();
+        resetMemoryBreak();
+        freeThreadStacks.clear();
+    }
+
+    U32 WAVMWasmModule::getMemoryBreak() {
+        faabric::util::UniqueLock lock(memoryMx);
+        syncMemoryBreak();
+        return (U32) (memoryBreakPages * WASM_BYTES_PER_PAGE);
+    }
+
+    /**
+     * Moves the break up to cover the target (relative to the current break if requested,
+     * i.e. for sbrk). Reading the break and mapping past it happen under one lock, so
+     * threads calling brk/sbrk concurrently can't be handed the same pages. Returns the
+     * previous break, or -ENOMEM if the target is past the max size of memory.
+     */
+    I32 WAVMWasmModule::moveMemoryBreak(U32 target, bool relative) {
+        faabric::util::UniqueLock lock(memoryMx);
+        syncMemoryBreak();
+
+        U32 previousBreak = (U32) (memoryBreakPages * WASM_BYTES_PER_PAGE);
+        U32 targetBreak = relative ? previousBreak + target : target;
+        Uptr targetPages = getNumberOfWasmPagesForBytes(targetBreak);
+        if (targetPages > getMemoryType(defaultMemory).size.max) {
+            return -ENOMEM;
+        }
+
+        // Nothing to be done if the break is already past the target
+        if (targetPages > memoryBreakPages) {
+            faabric::util::getLogger()->debug("brk - Moving break from {} to {} pages", memoryBreakPages,
+                                              targetPages);
+            doMmapPages(targetPages - memoryBreakPages);
+        }
+
+        return (I32) previousBreak;
+    }
+
+    U32 WAVMWasmModule::getStackPointer() const {
+        return executionContext->runtimeData->mutableGlobals[0].u32;
     }
 
     uint8_t *WAVMWasmModule::wasmPointerToNative(int32_t wasmPtr) {
@@ -935,17 +1448,13 @@ namespace wasm {
 
                     // Check other dynamic modules if not found in main module
                     if (!resolvedFunc) {
-                        for (auto m : dynamicModuleMap) {
-                            resolvedFunc = getInstanceExport(m.second, name);
-                            if (resolvedFunc) {
-                                break;
-                            }
-                        }
+                        resolvedFunc = getDynamicModuleExport(name);
                     }
 
                     // If we've found something, add it to the table
                     if (resolvedFunc) {
                         tableIdx = addFunctionToTable(resolvedFunc);
+                        pinnedTableSlots.insert(tableIdx);
                         globalOffsetTableMap.insert({name, tableIdx});
                     }
                 }
@@ -954,12 +1463,8 @@ namespace wasm {
                 // TODO - what causes this?
                 if (tableIdx == -1) {
                     // Create a new entry in the table and use this, but mark it to be filled later
-                    Uptr newIdx;
-                    Runtime::GrowResult result = Runtime::growTable(defaultTable, 1, &newIdx);
-
-                    if (result != Runtime::GrowResult::success) {
-                        throw std::runtime_error("Failed to grow table");
-                    }
+                    Uptr newIdx = allocateTableSlot();
+                    pinnedTableSlots.insert(newIdx);
 
                     tableIdx = (int) newIdx;
 
@@ -1009,12 +1514,7 @@ namespace wasm {
 
                 // Check other dynamically loaded modules for the export
                 if (!resolved) {
-                    for (auto &m : dynamicModuleMap) {
-                        resolved = getInstanceExport(m.second, name);
-                        if (resolved) {
-                            break;
-                        }
-                    }
+                    resolved = getDynamicModuleExport(name);
                 }
             }
         }
@@ -1066,6 +1566,41 @@ namespace wasm {
         return dynamicModuleCount;
     }
 
+    /**
+     * Paths of the loaded dynamic modules, in the order they were loaded (which
+     * determines their handles and table layout).
+     */
+    std::vector<std::string> WAVMWasmModule::getDynamicModulePaths() const {
+        std::vector<std::pair<int, std::string>> byHandle;
+        for (auto &p : dynamicPathToHandleMap) {
+            byHandle.emplace_back(p.second, p.first);
+        }
+        std::sort(byHandle.begin(), byHandle.end());
+
+        std::vector<std::string> paths;
+        for (auto &p : byHandle) {
+            paths.emplace_back(p.second);
+        }
+
+        return paths;
+    }
+
+    /**
+     * Loads the given dynamic modules up front, as if they'd been opened by the
+     * function, so that clones of this module don't have to. Modules already loaded
+     * are skipped.
+     */
+    void WAVMWasmModule::preloadDynamicModules(const std::vector<std::string> &paths) {
+        // Running the modules' initialisers changes the executing module
+        WAVMWasmModule *previousModule = getExecutingWAVMModule();
+
+        for (const auto &path : paths) {
+            dynamicLoadModule(path, executionContext);
+        }
+
+        setExecutingModule(previousModule);
+    }
+
     int WAVMWasmModule::getNextMemoryBase() {
         return nextMemoryBase;
     }
@@ -1098,17 +1633,33 @@ namespace wasm {
         return globalOffsetMemoryMap[name];
     }
 
+    /**
+     * Writes memory to the fd leaving zero pages as holes, so that they don't take up
+     * space in the fd. Pages of anonymous memory that have never been touched must be
+     * zero so are skipped without reading them. Memory mapped from another fd has to be
+     * scanned in full.
+     */
     void WAVMWasmModule::writeMemoryToFd(int fd) {
-        memoryFd = fd;
-
         const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
-        logger->debug("Writing memory for {}/{} to fd {}", this->boundUser, this->boundFunction, memoryFd);
+        logger->debug("Writing memory for {}/{} to fd {}", this->boundUser, this->boundFunction, fd);
+
+        PROF_START(writeMemoryToFd)
 
         Uptr numPages = Runtime::getMemoryNumPages(defaultMemory);
         Uptr numBytes = numPages * WASM_BYTES_PER_PAGE;
         U8 *memoryBase = Runtime::getMemoryBaseAddress(defaultMemory);
 
-        // Make the fd big enough
+        std::vector<PageRange> candidateRanges;
+        if (memoryFd > 0) {
+            candidateRanges.emplace_back(0, numBytes);
+        } else {
+            candidateRanges = getPopulatedPageRanges(memoryBase, numBytes);
+        }
+
+        memoryFd = fd;
+        memoryFdGeneration = ++memoryFdCounter;
+
+        // Make the fd big enough, anything not written is left as a hole
         memoryFdSize = numBytes;
         int ferror = ftruncate(memoryFd, memoryFdSize);
         if (ferror) {
@@ -1116,54 +1667,401 @@ namespace wasm {
         }
 
         // Write the data
-        ssize_t werror = write(memoryFd, memoryBase, memoryFdSize);
-        if (werror == -1) {
-            logger->error("write call failed");
+        size_t bytesWritten = 0;
+        for (const auto &r : candidateRanges) {
+            bytesWritten += writeNonZeroPages(memoryFd, memoryBase, r);
         }
+
+        PROF_END(writeMemoryToFd)
+
+        logger->debug("Wrote {}/{} bytes of memory to fd {}", bytesWritten, memoryFdSize, memoryFd);
     }
 
+    /**
+     * Only the parts of the fd holding data are mapped. The memory is freshly created
+     * when cloning, so is already zero where the fd has holes.
+     */
     void WAVMWasmModule::mapMemoryFromFd() {
         const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
         logger->debug("Mapping memory for {}/{} from fd {}", this->boundUser, this->boundFunction, memoryFd);
 
         U8 *memoryBase = Runtime::getMemoryBaseAddress(defaultMemory);
 
-        mmap(memoryBase, memoryFdSize, PROT_WRITE, MAP_PRIVATE | MAP_FIXED, memoryFd, 0);
+        std::vector<PageRange> dataRanges = getFileDataRanges(memoryFd, memoryFdSize, MIN_UNMAPPED_HOLE_SIZE);
+        for (const auto &r : dataRanges) {
+            void *res = mmap(memoryBase + r.first, r.second, PROT_WRITE, MAP_PRIVATE | MAP_FIXED, memoryFd,
+                             (off_t) r.first);
+            if (res == MAP_FAILED) {
+                logger->error("Failed to map memory from fd {} ({} - {})", memoryFd, errno, strerror(errno));
+                throw std::runtime_error("Failed to map memory from fd");
+            }
+
+            adviseHugePages(r.first, r.second);
+        }
+    }
+
+    /**
+     * Asks for huge pages over the given range of memory, if configured for this function.
+     * Advice is attached to the host mapping, so has to be given again wherever part of
+     * memory is remapped. Memory mapped from a zygote's fd gets huge pages for the fd's
+     * contents where the kernel allows it for shared memory, and copy-on-write pages stay
+     * normal size. Dirty page tracking works as normal, but writes to untouched anonymous
+     * memory dirty a whole huge page.
+     *
+     * Failure isn't fatal, it just means normal pages (e.g. the kernel has THP disabled).
+     */
+    void WAVMWasmModule::adviseHugePages(Uptr offset, Uptr length) {
+        if (!hugePages || length == 0) {
+            return;
+        }
+
+        U8 *memoryBase = Runtime::getMemoryBaseAddress(defaultMemory);
+        if (madvise(memoryBase + offset, length, MADV_HUGEPAGE) != 0) {
+            faabric::util::getLogger()->debug("Unable to use huge pages for {} bytes at {} ({} - {})", length,
+                                              offset, errno, strerror(errno));
+        }
+    }
+
+    /**
+     * The whole of memory up to its max is reserved up front, so advice given over all
+     * of it covers pages committed as memory grows later on.
+     */
+    Uptr WAVMWasmModule::getMaxMemoryBytes() {
+        U64 maxPages = std::min<U64>(getMemoryType(defaultMemory).size.max, (U64) MAX_MEMORY_PAGES);
+        return maxPages * WASM_BYTES_PER_PAGE;
+    }
+
+    size_t WAVMWasmModule::getMemoryFdSize() {
+        return memoryFdSize;
+    }
+
+    /**
+     * Zero pages are left as holes in the fd, so this is usually well below its size
+     */
+    size_t WAVMWasmModule::getMemoryFdAllocatedBytes() {
+        if (memoryFd <= 0) {
+            return 0;
+        }
+
+        struct stat fdStat{};
+        if (fstat(memoryFd, &fdStat) != 0) {
+            faabric::util::getLogger()->error("Failed to stat memory fd {} ({} - {})", memoryFd, errno,
+                                              strerror(errno));
+            throw std::runtime_error("Failed to stat memory fd");
+        }
+
+        // st_blocks is always in 512-byte units
+        return ((size_t) fdStat.st_blocks) * 512;
+    }
+
+    /**
+     * Bytes of linear memory held by this module alone, i.e. resident or swapped pages
+     * which aren't just mapped from a file. Untouched pages and those read straight from
+     * the fd aren't counted.
+     */
+    size_t WAVMWasmModule::getPrivateMemoryBytes() {
+        U8 *memoryBase = Runtime::getMemoryBaseAddress(defaultMemory);
+        size_t memSize = Runtime::getMemoryNumPages(defaultMemory) * WASM_BYTES_PER_PAGE;
+
+        size_t total = 0;
+        for (const auto &r : getDirtyPageRanges(memoryBase, memSize)) {
+            total += r.second;
+        }
+
+        return total;
+    }
+
+    /**
+     * Resets this module to the state of the zygote it was cloned from, without tearing
+     * down the compartment. Only the pages written since the memory was mapped from the
+     * zygote's fd are discarded, so the cost scales with the pages a call has dirtied
+     * rather than the size of the memory.
+     *
+     * Returns false if the module has diverged from the zygote in a way that can't be
+     * undone here (grown memory or table, dynamic linking changes, unmapped memory from
+     * the fd), in which case the caller
+     * needs to do a full clone.
+     */
+    bool WAVMWasmModule::resetDirtyPages(const WAVMWasmModule &zygote) {
+        const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+
+        if (!_isBound || !zygote._isBound) {
+            return false;
+        }
+
+        if (memoryFd <= 0 || memoryFd != zygote.memoryFd || memoryFdGeneration != zygote.memoryFdGeneration ||
+            memoryFdSize != zygote.memoryFdSize) {
+            logger->debug("Cannot reset dirty pages, {}/{} not mapped from zygote fd", boundUser, boundFunction);
+            return false;
+        }
+
+        Uptr numPages = Runtime::getMemoryNumPages(defaultMemory);
+        Uptr zygoteNumPages = Runtime::getMemoryNumPages(zygote.defaultMemory);
+        Uptr numTableElems = Runtime::getTableNumElements(defaultTable);
+        Uptr zygoteNumTableElems = Runtime::getTableNumElements(zygote.defaultTable);
+        if (numPages != zygoteNumPages || numTableElems != zygoteNumTableElems ||
+            dynamicModuleCount != zygote.dynamicModuleCount || dynamicLinkChanges != zygote.dynamicLinkChanges ||
+            unmappedFromFd) {
+            logger->debug("Cannot reset dirty pages, {}/{} has diverged from zygote (pages {}->{}, table {}->{})",
+                          boundUser, boundFunction, zygoteNumPages, numPages, zygoteNumTableElems, numTableElems);
+            return false;
+        }
+
+        PROF_START(resetDirtyPages)
+
+        // The OpenMP workers hold on to their stacks until they're joined
+        OMPPool.reset();
+
+        // Revert the written pages to the zygote's contents
+        U8 *memoryBase = Runtime::getMemoryBaseAddress(defaultMemory);
+        std::vector<PageRange> dirtyRanges = getDirtyPageRanges(memoryBase, memoryFdSize);
+        discardPageRanges(memoryBase, dirtyRanges);
+
+        // Reset the mutable globals (e.g. the stack pointer)
+        memcpy(executionContext->runtimeData->mutableGlobals,
+               zygote.executionContext->runtimeData->mutableGlobals,
+               sizeof(executionContext->runtimeData->mutableGlobals));
+
+        // Reset the Faasm-level state as done when cloning
+        filesystem = zygote.filesystem;
+        wasmEnvironment = zygote.wasmEnvironment;
+        sharedMemWasmPtrs = zygote.sharedMemWasmPtrs;
+
+        // Memory has been put back as it was, so the same ranges, stacks and reserved
+        // pages are free
+        freeMemoryRanges = zygote.freeMemoryRanges;
+        memoryBreakPages = zygote.memoryBreakPages;
+        memoryReservedPages = zygote.memoryReservedPages;
+        freeThreadStacks = zygote.freeThreadStacks;
+
+        // The table hasn't changed, but dlopen/dlsym bookkeeping may have
+        dynamicModuleSymbolSlots = zygote.dynamicModuleSymbolSlots;
+        dynamicModuleOpenCounts = zygote.dynamicModuleOpenCounts;
+
+        stdoutMemFd = 0;
+        stdoutSize = 0;
+
+        resetIncrementalSnapshot();
+
+        PROF_END(resetDirtyPages)
+
+        logger->debug("Reset {} dirty page ranges of {}/{} from zygote", dirtyRanges.size(), boundUser,
+                      boundFunction);
+
+        return true;
+    }
+
+    /**
+     * Works out which bytes of memory have changed relative to the zygote this module
+     * was cloned from. If the memory is still mapped from the zygote's fd, only the
+     * pages written since cloning need comparing, otherwise all of memory is compared.
+     * Anything beyond the end of the zygote's memory is compared against zeroes.
+     */
+    std::vector<uint8_t> WAVMWasmModule::getMemoryDiff(const WAVMWasmModule &zygote, size_t excludeBelow) {
+        PROF_START(memoryDiff)
+
+        U8 *memBase = Runtime::getMemoryBaseAddress(defaultMemory);
+        U8 *zygoteMemBase = Runtime::getMemoryBaseAddress(zygote.defaultMemory);
+        size_t memSize = Runtime::getMemoryNumPages(defaultMemory) * WASM_BYTES_PER_PAGE;
+        size_t zygoteMemSize = Runtime::getMemoryNumPages(zygote.defaultMemory) * WASM_BYTES_PER_PAGE;
+        size_t commonSize = std::min(memSize, zygoteMemSize);
+
+        std::vector<ByteRun> runs;
+        bool mappedFromZygote = memoryFd > 0 && memoryFd == zygote.memoryFd &&
+                                memoryFdGeneration == zygote.memoryFdGeneration &&
+                                memoryFdSize == zygoteMemSize;
+        if (mappedFromZygote) {
+            for (const auto &r : getDirtyPageRanges(memBase, commonSize)) {
+                size_t start = std::max(r.first, excludeBelow);
+                size_t end = std::min(r.first + r.second, commonSize);
+                if (start < end) {
+                    findChangedBytes(memBase, zygoteMemBase, start, end, runs);
+                }
+            }
+        } else if (excludeBelow < commonSize) {
+            findChangedBytes(memBase, zygoteMemBase, excludeBelow, commonSize, runs);
+        }
+
+        size_t grownStart = std::max(commonSize, excludeBelow);
+        if (grownStart < memSize) {
+            findChangedBytes(memBase, nullptr, grownStart, memSize, runs);
+        }
+
+        std::vector<uint8_t> diff = serialiseMemoryDiff(memBase, runs);
+
+        PROF_END(memoryDiff)
+
+        return diff;
+    }
+
+    void WAVMWasmModule::applyMemoryDiff(const uint8_t *diff, size_t diffSize) {
+        // Grow memory if the diff goes beyond the end
+        faabric::util::UniqueLock lock(memoryMx);
+        size_t extent = getMemoryDiffExtent(diff, diffSize);
+        Uptr currentNumPages = Runtime::getMemoryNumPages(defaultMemory);
+        Uptr requiredNumPages = getNumberOfWasmPagesForBytes(extent);
+        if (requiredNumPages > currentNumPages) {
+            growMemoryPages(requiredNumPages - currentNumPages);
+        }
+
+        U8 *memBase = Runtime::getMemoryBaseAddress(defaultMemory);
+        size_t memSize = Runtime::getMemoryNumPages(defaultMemory) * WASM_BYTES_PER_PAGE;
+        wasm::applyMemoryDiff(memBase, memSize, diff, diffSize);
+    }
+
+    size_t WAVMWasmModule::prepareSnapshot() {
+        Uptr numPages = Runtime::getMemoryNumPages(defaultMemory);
+        U8 *memBase = Runtime::getMemoryBaseAddress(defaultMemory);
+
+        preparedSnapshot = std::make_unique<wasm::SnapshotPlan>(wasm::planMemorySnapshot(memBase, numPages));
+
+        return preparedSnapshot->getSerialisedSize();
     }
 
     void WAVMWasmModule::doSnapshot(std::ostream &outStream) {
-        cereal::BinaryOutputArchive archive(outStream);
+        PROF_START(wasmSnapshot)
+
+        if (!preparedSnapshot) {
+            prepareSnapshot();
+        }
 
-        // Serialise memory
+        // Stream non-zero chunks straight from memory
+        U8 *memBase = Runtime::getMemoryBaseAddress(defaultMemory);
+        std::unique_ptr<wasm::SnapshotPlan> plan = std::move(preparedSnapshot);
+        wasm::writeMemorySnapshot(*plan, memBase, outStream);
+
+        PROF_END(wasmSnapshot)
+    }
+
+    /**
+     * Snapshots memory to state for restoring elsewhere (e.g. when spawning chained
+     * threads). The first snapshot with a given base key is a full snapshot. Later ones
+     * (e.g. later parallel regions in the same call) only push the chunks changed since
+     * the previous one, as a delta under a new version of the key. Hosts build each
+     * version from the one before it plus its delta.
+     *
+     * If given, the caller's stack pointer is recorded so that threads restored from the
+     * snapshot start their stacks below the caller's frames rather than on top of them.
+     *
+     * Returns the size of what was pushed, and sets the key to restore from.
+     */
+    size_t WAVMWasmModule::snapshotIncrementalToState(const std::string &baseKey, std::string &snapshotKey,
+                                                      uint32_t stackPointer) {
+        PROF_START(incrementalSnapshot)
+
+        faabric::util::UniqueLock lock(memoryMx);
         Uptr numPages = Runtime::getMemoryNumPages(defaultMemory);
         U8 *memBase = Runtime::getMemoryBaseAddress(defaultMemory);
-        U8 *memEnd = memBase + (numPages * WASM_BYTES_PER_PAGE);
 
-        wasm::MemorySerialised mem;
-        mem.numPages = numPages;
-        mem.data = std::vector<uint8_t>(memBase, memEnd);
+        std::string stateKey;
+        if (baseKey != incrementalSnapshotKey) {
+            incrementalSnapshotKey = baseKey;
+            incrementalSnapshotVersion = 0;
+
+            // Start tracking writes before reading memory, so nothing is missed
+            incrementalSnapshotImage.clear();
+            incrementalSnapshotTracker.reset();
+
+            preparedSnapshot = std::make_unique<wasm::SnapshotPlan>(wasm::planMemorySnapshot(memBase, numPages));
+
+            stateKey = baseKey;
+            snapshotKey = baseKey;
+        } else {
+            incrementalSnapshotVersion++;
+
+            // Only pages written since the last version can have changed
+            std::vector<PageRange> dirtyRanges = incrementalSnapshotTracker.getDirtyPageRangesAndReset(
+                    memBase, numPages * WASM_BYTES_PER_PAGE);
+
+            preparedSnapshot = std::make_unique<wasm::SnapshotPlan>(
+                    wasm::planMemorySnapshotDelta(memBase, numPages, dirtyRanges, incrementalSnapshotImage)
+            );
+
+            stateKey = wasm::getSnapshotDeltaKey(baseKey, incrementalSnapshotVersion);
+            snapshotKey = wasm::getVersionedSnapshotKey(baseKey, incrementalSnapshotVersion);
+        }
+
+        preparedSnapshot->stackPointer = stackPointer;
+        lock.unlock();
+
+        size_t stateSize;
+        try {
+            stateSize = writeSnapshotToState(stateKey, preparedSnapshot->getSerialisedSize());
+        } catch (const std::exception &e) {
+            // Image no longer matches what's in state, so start again next time
+            resetIncrementalSnapshot();
+            throw;
+        }
+
+        const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+        logger->debug("Pushed snapshot {} ({} bytes)", snapshotKey, stateSize);
 
-        // Serialise to file
-        archive(mem);
+        PROF_END(incrementalSnapshot)
+
+        return stateSize;
+    }
+
+    void WAVMWasmModule::resetIncrementalSnapshot() {
+        incrementalSnapshotKey.clear();
+        incrementalSnapshotVersion = 0;
+        incrementalSnapshotImage.clear();
+        incrementalSnapshotTracker.release();
     }
 
     void WAVMWasmModule::doRestore(std::istream &inStream) {
-        cereal::BinaryInputArchive archive(inStream);
+        PROF_START(wasmRestore)
 
-        // Read in serialised data
-        wasm::MemorySerialised mem;
-        archive(mem);
+        wasm::SnapshotHeader header = wasm::readMemorySnapshotHeader(inStream);
 
-        // Restore memory
+        // Make sure memory is big enough. Anything reserved or free is overwritten.
+        faabric::util::UniqueLock lock(memoryMx);
+        resetFreeMemory();
         Uptr currentNumPages = Runtime::getMemoryNumPages(defaultMemory);
-        size_t pagesRequired = mem.numPages - currentNumPages;
-        if (pagesRequired > 0) {
-            mmapPages(pagesRequired);
+        if (header.numPages > currentNumPages) {
+            growMemoryPages(header.numPages - currentNumPages);
         }
 
         U8 *memBase = Runtime::getMemoryBaseAddress(defaultMemory);
-        size_t memSize = mem.numPages * WASM_BYTES_PER_PAGE;
-        memcpy(memBase, mem.data.data(), memSize);
+        wasm::readMemorySnapshot(header, inStream, memBase);
+
+        if (header.stackPointer > 0) {
+            executionContext->runtimeData->mutableGlobals[0] = header.stackPointer;
+        }
+
+        PROF_END(wasmRestore)
+    }
+
+    void WAVMWasmModule::doSnapshotToMappableFile(int fd) {
+        PROF_START(wasmSnapshotMappable)
+
+        Uptr numPages = Runtime::getMemoryNumPages(defaultMemory);
+        U8 *memBase = Runtime::getMemoryBaseAddress(defaultMemory);
+        wasm::writeMappableSnapshot(fd, memBase, numPages);
+
+        PROF_END(wasmSnapshotMappable)
+    }
+
+    void WAVMWasmModule::doRestoreFromMappableFile(int fd, const MappableSnapshotHeader &header) {
+        PROF_START(wasmRestoreMappable)
+
+        // Make sure memory is big enough. Anything reserved or free is overwritten.
+        faabric::util::UniqueLock lock(memoryMx);
+        resetFreeMemory();
+        Uptr currentNumPages = Runtime::getMemoryNumPages(defaultMemory);
+        if (header.numPages > currentNumPages) {
+            growMemoryPages(header.numPages - currentNumPages);
+        }
+
+        U8 *memBase = Runtime::getMemoryBaseAddress(defaultMemory);
+        wasm::mapMappableSnapshot(fd, header, memBase);
+        adviseHugePages(0, header.numPages * WASM_BYTES_PER_PAGE);
+
+        // Memory is no longer backed by the zygote's fd, so clones and resets can't rely on it
+        memoryFd = -1;
+        memoryFdSize = 0;
+        memoryFdGeneration = 0;
+
+        PROF_END(wasmRestoreMappable)
     }
 
 
@@ -1175,7 +2073,7 @@ namespace wasm {
         const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
         // Create a new region for this thread's stack
         U32 thisStackBase = spec.stackTop;
-        U32 stackTop = thisStackBase + THREAD_STACK_SIZE - 1;
+        U32 stackTop = thisStackBase + threadStackSize - 1;
 
         // Create a new context for this thread
         Runtime::Context *threadContext = createContext(
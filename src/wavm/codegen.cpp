@@ -1,5 +1,7 @@
 #include "WAVMWasmModule.h"
 
+#include <ir_cache/ObjectCache.h>
+
 #include <WAVM/Runtime/Runtime.h>
 #include <WAVM/IR/Types.h>
 #include <WAVM/IR/Module.h>
@@ -15,9 +17,8 @@ namespace wasm {
     std::vector<uint8_t> wavmCodegen(std::vector<uint8_t> &bytes) {
         IR::Module moduleIR;
 
-        // Explicitly allow simd support
-        moduleIR.featureSpec.simd = true;
-        moduleIR.featureSpec.atomics = true;
+        // Must match the features the object cache is keyed on
+        setCodegenFeatures(moduleIR.featureSpec);
 
         if (faabric::util::isWasm(bytes)) {
             // Handle WASM
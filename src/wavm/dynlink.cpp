@@ -50,7 +50,7 @@ namespace wasm {
     WAVM_DEFINE_INTRINSIC_FUNCTION(env, "dlclose", I32, dlclose, I32 handle) {
         faabric::util::getLogger()->debug("S - _dlclose {}", handle);
 
-        // Ignore
-        return 0;
+        bool success = getExecutingWAVMModule()->dynamicUnloadModule(handle);
+        return success ? 0 : 1;
     }
 }
\ No newline at end of file
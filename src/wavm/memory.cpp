@@ -23,7 +23,7 @@ namespace wasm {
     I32 s__madvise(I32 address, I32 numBytes, I32 advice) {
         faabric::util::getLogger()->debug("S - madvise - {} {} {}", address, numBytes, advice);
 
-        return 0;
+        return getExecutingWAVMModule()->adviseMemory((U32) address, (U32) numBytes, advice);
     }
 
     I32 s__membarrier(I32 a) {
@@ -118,40 +118,14 @@ namespace wasm {
 
     I32 doMunmap(I32 addr, I32 length) {
         const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
-        logger->debug("S - munmap - {} {} (IGNORED)", addr, length);
-
-//        WasmModule *executingModule = getExecutingWAVMModule();
-//        Runtime::Memory *memory = executingModule->defaultMemory;
-//
-//        // If not aligned or zero length, drop out
-//        if (!isPageAligned(addr)) {
-//            logger->warn("munmap address not page-aligned ({})", addr);
-//            return -EINVAL;
-//        } else if (length == 0) {
-//            logger->warn("munmap size zero");
-//            return -EINVAL;
-//        }
-//
-//        const Uptr addrPageBase = addr / IR::numBytesPerPage;
-//        const Uptr numPages = getNumberOfWasmPagesForBytes(length);
-//
-//        // Drop out if we're munmapping over the max page boundary
-//        if (addrPageBase + numPages > getMemoryType(memory).size.max) {
-//            logger->warn("munmapping region over max memory pages");
-//            return -EINVAL;
-//        }
-//
-//        // Unmap the memory
-//        unmapMemoryPages(memory, addrPageBase, numPages);
-        return 0;
+        logger->debug("S - munmap - {} {}", addr, length);
+
+        return getExecutingWAVMModule()->munmapMemory((U32) addr, (U32) length);
     }
 
     /*
-     * Although we let things call munmap, we don't actually want to bother as the memory can't
-     * be reused for that module anyway.
-     *
-     * NOTE - ENABLING THIS BREAKS MEMORY CLONING
-     * By unmapping some pages in a memory, we can't then reuse that memory when cloned.
+     * The pages aren't actually removed from the memory, as that would break cloning.
+     * Instead they're released and kept for reuse by later mmaps.
      */
     I32 s__munmap(I32 addr, I32 length) {
         return doMunmap(addr, length);
@@ -179,40 +153,21 @@ namespace wasm {
         }
 
         WAVMWasmModule *module = getExecutingWAVMModule();
-        Runtime::Memory *memory = module->defaultMemory;
-
-        Uptr currentPageCount = getMemoryNumPages(memory);
-        const U32 currentBreak = (U32) (currentPageCount * WASM_BYTES_PER_PAGE);
 
         // Return current break if addr is zero
         if (addr == 0) {
-            return currentBreak;
+            return module->getMemoryBreak();
         }
 
-        Uptr targetPageCount = getNumberOfWasmPagesForBytes(addr);
-        Uptr maxPages = getMemoryType(memory).size.max;
-
-        // Check if expanding too far
-        if (targetPageCount > maxPages) {
+        // Move the break up, growing memory if it's not already reserved. The break can be
+        // below the end of memory if pages have been reserved.
+        I32 previousBreak = module->moveMemoryBreak((U32) addr, false);
+        if (previousBreak == -ENOMEM) {
             return -ENOMEM;
         }
 
-        // Nothing to be done if memory already big enough
-        if (targetPageCount <= currentPageCount) {
-            return currentBreak;
-        }
-
-        // Grow memory as required
-        Uptr expansion = targetPageCount - currentPageCount;
-        logger->debug("brk - Growing memory from {} to {} pages", currentPageCount, targetPageCount);
-        Uptr prevPageCount = 0;
-        Runtime::GrowResult growResult = growMemory(memory, expansion, &prevPageCount);
-        if (growResult != Runtime::GrowResult::success) {
-            throw std::runtime_error("Something has gone wrong with brk logic");
-        }
-
-        // Success, return requested break (note, this might be lower than the memory we actually allocated)
-        return (U32) addr;
+        // Success, return the new break (note, this might be lower than the memory we actually allocated)
+        return (I32) std::max<U32>((U32) previousBreak, (U32) addr);
     }
 
     I32 s__brk(I32 addr) {
@@ -226,25 +181,20 @@ namespace wasm {
         faabric::util::getLogger()->debug("S - sbrk - {}", increment);
 
         WAVMWasmModule *module = getExecutingWAVMModule();
-        Runtime::Memory *memory = module->defaultMemory;
-
-        Uptr currentPageCount = getMemoryNumPages(memory);
-        const U32 currentBreak = (U32) (currentPageCount * WASM_BYTES_PER_PAGE);
 
         // Calling sbrk with zero is the same as calling brk with zero
         if (increment == 0) {
-            return currentBreak;
+            return module->getMemoryBreak();
         }
 
-        U32 target = currentBreak + increment;
-
-        // Normal brk, but we want to return the start of the region that's been created (i.e. the old break)
-        I32 brkResult = _do_brk(target);
-        if (brkResult == -1) {
-            return -1;
-        } else {
-            return currentBreak;
+        if (!isPageAligned(increment)) {
+            faabric::util::getLogger()->error("sbrk increment not page-aligned ({})", increment);
+            throw std::runtime_error("sbrk not page-aligned");
         }
+
+        // Like brk, but the break is read and moved in one go, as another thread may be
+        // moving it too. Returns the start of the region that's been created (i.e. the old break).
+        return module->moveMemoryBreak((U32) increment, true);
     }
 
     // mprotect is usually called as part of thread creation, in which
@@ -265,18 +265,15 @@ namespace wasm {
             std::vector<int> chainedThreads;
             chainedThreads.reserve(nextNumThreads);
 
-            std::string activeSnapshotKey;
-            size_t threadSnapshotSize;
-
-            // TODO - Implement different cases like calling parallel section in a loop
-            // Or calling several parallel sections to cache snapshots as much as possible
-            int32_t callId = std::rand() % 100'000;
-            activeSnapshotKey = fmt::format("fork_{}", callId);
-            threadSnapshotSize = parentModule->snapshotToState(activeSnapshotKey);
-
             faabric::scheduler::Scheduler &sch = faabric::scheduler::getScheduler();
 
             const faabric::Message *originalCall = getExecutingCall();
+
+            // Parallel sections after the first in this call only push what's changed
+            std::string activeSnapshotKey;
+            const std::string baseSnapshotKey = fmt::format("fork_{}", originalCall->id());
+            size_t threadSnapshotSize = parentModule->snapshotIncrementalToState(baseSnapshotKey, activeSnapshotKey);
+
             const std::string origStr = faabric::util::funcToString(*originalCall, false);
 
             U32 *nativeArgs = Runtime::memoryArrayPtr<U32>(memoryPtr, argsPtr, argc);
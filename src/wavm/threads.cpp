@@ -3,7 +3,11 @@
 
 #include <linux/futex.h>
 
+#include <conf/FaasmConfig.h>
+#include <faabric/state/State.h>
 #include <faabric/util/config.h>
+#include <faabric/util/timing.h>
+#include <wasm/serialisation.h>
 
 #include <WAVM/Runtime/Runtime.h>
 #include <WAVM/Runtime/Intrinsics.h>
@@ -24,9 +28,9 @@ namespace wasm {
     // Map of tid to message ID for chained calls
     static thread_local std::unordered_map<I32, unsigned int> chainedThreads;
 
-    // Flag to say whether we've spawned a thread
-    static std::string activeSnapshotKey;
-    static size_t threadSnapshotSize;
+    // Snapshot for the current set of chained threads, reset once they've all been joined
+    static thread_local std::string activeSnapshotKey;
+    static thread_local size_t threadSnapshotSize;
 
     I64 createPthread(void *threadSpecPtr) {
         // Set up TLS for this thread
@@ -35,6 +39,9 @@ namespace wasm {
         setExecutingCall(pArg->parentCall);
         I64 res = getExecutingWAVMModule()->executeThreadLocally(*pArg->spec);
 
+        // Return the stack to the pool for the next thread
+        pArg->parentModule->releaseThreadStack(pArg->spec->stackTop);
+
         // Delete the spec, no longer needed
         delete[] pArg->spec->funcArgs;
         delete pArg->spec;
@@ -97,11 +104,14 @@ namespace wasm {
             localThreads.insert({pthreadPtr, Platform::createThread(0, createPthread, pArgs)});
 
         } else if (conf.threadMode == "chain") {
-            // Create a new zygote if one isn't already active
+            // Create a new zygote if one isn't already active. After the first one in this
+            // call, this will be a delta against the previous one.
             if (activeSnapshotKey.empty()) {
                 int callId = getExecutingCall()->id();
-                activeSnapshotKey = std::string("pthread_snapshot_") + std::to_string(callId);
-                threadSnapshotSize = thisModule->snapshotToState(activeSnapshotKey);
+                std::string baseKey = std::string("pthread_snapshot_") + std::to_string(callId);
+                U32 stackPointer = contextRuntimeData->mutableGlobals[0].u32;
+                threadSnapshotSize = thisModule->snapshotIncrementalToState(baseKey, activeSnapshotKey,
+                                                                            stackPointer);
             }
 
             // Chain the threaded call
@@ -117,6 +127,40 @@ namespace wasm {
         return 0;
     }
 
+    /**
+     * Applies the bytes changed by a chained thread to this module's memory. Threads are
+     * merged in the order they're joined, so if two threads wrote the same byte the
+     * last one joined wins. Bytes neither wrote are left alone.
+     *
+     * Returns false if the thread's diff couldn't be read, in which case its writes
+     * would be lost.
+     */
+    static bool mergeChainedThreadMemory(unsigned int callId) {
+        const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
+        WAVMWasmModule *thisModule = getExecutingWAVMModule();
+
+        std::string diffKey = getThreadMemoryDiffKey(activeSnapshotKey, callId);
+        faabric::state::State &state = faabric::state::getGlobalState();
+
+        size_t diffSize;
+        std::shared_ptr<faabric::state::StateKeyValue> kv;
+        try {
+            diffSize = state.getStateSize(thisModule->getBoundUser(), diffKey);
+            kv = state.getKV(thisModule->getBoundUser(), diffKey, diffSize);
+            kv->pull();
+        } catch (std::runtime_error &e) {
+            logger->error("Failed reading memory diff for thread {} ({})", callId, e.what());
+            return false;
+        }
+
+        PROF_START(mergeThreadMemory)
+        thisModule->applyMemoryDiff(kv->get(), diffSize);
+        PROF_END(mergeThreadMemory)
+
+        logger->debug("Merged {} byte memory diff from thread {}", diffSize, callId);
+        return true;
+    }
+
     WAVM_DEFINE_INTRINSIC_FUNCTION(env, "pthread_join", I32, pthread_join, I32 pthreadPtr, I32 resPtrPtr) {
         const std::shared_ptr<spdlog::logger> &logger = faabric::util::getLogger();
         logger->debug("S - pthread_join - {} {}", pthreadPtr, resPtrPtr);
@@ -135,6 +179,12 @@ namespace wasm {
             unsigned int callId = chainedThreads[pthreadPtr];
             returnValue = awaitChainedCall(callId);
 
+            // Merge the thread's memory writes back in
+            bool merged = true;
+            if (conf::getFaasmConfig().threadMemoryMerge == "on") {
+                merged = mergeChainedThreadMemory(callId);
+            }
+
             // Remove record for the remote thread
             chainedThreads.erase(pthreadPtr);
 
@@ -142,6 +192,11 @@ namespace wasm {
             if (chainedThreads.empty()) {
                 activeSnapshotKey = "";
             }
+
+            // Carrying on would leave the caller with memory missing the thread's writes
+            if (!merged) {
+                throw std::runtime_error("Failed merging chained thread memory");
+            }
         } else {
             logger->error("Unsupported threading mode: {}", conf.threadMode);
             throw std::runtime_error("Unsupported threading mode");
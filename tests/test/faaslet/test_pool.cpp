@@ -10,6 +10,7 @@ extern "C" {
 #include <faabric/util/bytes.h>
 #include <faabric/redis/Redis.h>
 
+#include <conf/FaasmConfig.h>
 #include <faaslet/FaasletPool.h>
 #include <faaslet/Faaslet.h>
 #include <emulator/emulator.h>
@@ -202,6 +203,53 @@ namespace tests {
         REQUIRE(afterPages == initialPages);
     }
 
+    TEST_CASE("Test async module reset swaps in spare module", "[faaslet]") {
+        cleanSystem();
+
+        conf::FaasmConfig &conf = conf::getFaasmConfig();
+        std::string originalAsyncReset = conf.asyncModuleReset;
+        conf.asyncModuleReset = "on";
+
+        faabric::Message call = faabric::util::messageFactory("demo", "heap");
+        setEmulatedMessage(call);
+
+        Faaslet w(1);
+
+        faabric::scheduler::Scheduler &sch = faabric::scheduler::getScheduler();
+        sch.callFunction(call);
+
+        // Process bind
+        w.processNextMessage();
+
+        wasm::WasmModule *moduleA = w.module.get();
+        Uptr initialPages = Runtime::getMemoryNumPages(
+                static_cast<wasm::WAVMWasmModule *>(moduleA)->defaultMemory
+        );
+
+        for (int i = 0; i < 3; i++) {
+            call.set_id(0);
+            faabric::util::setMessageId(call);
+            setEmulatedMessage(call);
+            sch.callFunction(call);
+
+            wasm::WasmModule *before = w.module.get();
+            w.processNextMessage();
+
+            faabric::Message result = sch.getFunctionResult(call.id(), 1);
+            REQUIRE(result.returnvalue() == 0);
+
+            // Module should have been swapped for the spare
+            REQUIRE(w.module.get() != before);
+            REQUIRE(w.spareModule.get() == before);
+
+            // Check the swapped in module is clean
+            auto *modulePtr = static_cast<wasm::WAVMWasmModule *>(w.module.get());
+            REQUIRE(Runtime::getMemoryNumPages(modulePtr->defaultMemory) == initialPages);
+        }
+
+        conf.asyncModuleReset = originalAsyncReset;
+    }
+
     TEST_CASE("Test mmap/munmap", "[faaslet]") {
         setUp();
 
@@ -0,0 +1,79 @@
+#include <catch/catch.hpp>
+
+#include "utils.h"
+
+#include <conf/FaasmConfig.h>
+#include <ir_cache/IRModuleCache.h>
+#include <wavm/WAVMWasmModule.h>
+#include <faabric/util/files.h>
+#include <faabric/util/func.h>
+
+#include <boost/filesystem.hpp>
+
+using namespace faaslet;
+
+namespace tests {
+    /**
+     * Moves a function's object file out of the way so its codegen looks unfinished,
+     * putting it back when this goes out of scope.
+     */
+    class HiddenObjectFile {
+    public:
+        explicit HiddenObjectFile(const faabric::Message &msg) : path(faabric::util::getFunctionObjectFile(msg)),
+                                                                 hiddenPath(path + ".hidden") {
+            boost::filesystem::rename(path, hiddenPath);
+        }
+
+        ~HiddenObjectFile() {
+            restore();
+        }
+
+        void restore() {
+            if (boost::filesystem::exists(hiddenPath)) {
+                boost::filesystem::rename(hiddenPath, path);
+            }
+        }
+
+    private:
+        std::string path;
+        std::string hiddenPath;
+    };
+
+    TEST_CASE("Test switching from interpreted to compiled tier", "[faaslet]") {
+        cleanSystem();
+
+        FaasmConfigGuard configGuard;
+        conf::getFaasmConfig().tieredExecution = "on";
+
+        wasm::IRModuleCache &irCache = wasm::getIRModuleCache();
+        irCache.clear();
+
+        faabric::Message msg = faabric::util::messageFactory("demo", "echo");
+        msg.set_inputdata("tiered");
+
+        FaasletPool pool(1);
+        Faaslet f(1);
+
+        // Without object code, the function starts off in the interpreter
+        HiddenObjectFile hiddenObjectFile(msg);
+        f.bindToFunction(msg);
+        REQUIRE(f.isInterpreted());
+        REQUIRE(f.module->execute(msg));
+        REQUIRE(msg.returnvalue() == 0);
+        REQUIRE(msg.outputdata() == "tiered");
+
+        // Once codegen is there, rebinding moves on to WAVM
+        hiddenObjectFile.restore();
+        irCache.awaitBackgroundCompiles();
+
+        f.bindToFunction(msg, true);
+        REQUIRE(!f.isInterpreted());
+        REQUIRE(dynamic_cast<wasm::WAVMWasmModule *>(f.module.get()) != nullptr);
+
+        faabric::Message compiledMsg = faabric::util::messageFactory("demo", "echo");
+        compiledMsg.set_inputdata("tiered");
+        REQUIRE(f.module->execute(compiledMsg));
+        REQUIRE(compiledMsg.returnvalue() == 0);
+        REQUIRE(compiledMsg.outputdata() == "tiered");
+    }
+}
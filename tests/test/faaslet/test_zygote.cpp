@@ -2,6 +2,7 @@
 
 #include "utils.h"
 
+#include <module_cache/WasmModuleCache.h>
 #include <faabric/util/func.h>
 
 namespace tests {
@@ -16,4 +17,21 @@ namespace tests {
         faabric::Message msg = faabric::util::messageFactory("demo", "zygote_check");
         checkMultipleExecutions(msg, 4);
     }
-}
\ No newline at end of file
+
+    TEST_CASE("Test repeat execution with dirty page zygote reset", "[faaslet]") {
+        cleanSystem();
+        faabric::Message msg = faabric::util::messageFactory("demo", "zygote_check");
+
+        module_cache::WasmModuleCache &registry = module_cache::getWasmModuleCache();
+        std::shared_ptr<wasm::WAVMWasmModule> cachedModule = registry.getCachedModule(msg);
+        wasm::WAVMWasmModule module(*cachedModule);
+
+        for (int i = 0; i < 4; i++) {
+            bool success = module.execute(msg);
+            REQUIRE(success);
+
+            // Function doesn't grow memory, so dirty reset should always apply
+            REQUIRE(module.resetDirtyPages(*cachedModule));
+        }
+    }
+}
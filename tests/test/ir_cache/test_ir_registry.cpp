@@ -7,6 +7,8 @@
 #include <ir_cache/IRModuleCache.h>
 #include <storage/FileLoader.h>
 
+#include <thread>
+
 namespace tests {
     void checkObjCode(const Runtime::ModuleRef moduleRef, const std::string &path) {
         const std::vector<uint8_t> fileBytes = faabric::util::readFileToBytes(path);
@@ -129,4 +131,73 @@ namespace tests {
         checkObjCode(objRefA1, objPathA);
         checkObjCode(objRefB1, objPathB);
     }
-}
\ No newline at end of file
+
+    TEST_CASE("Test shared library shared across functions", "[wasm]") {
+        wasm::IRModuleCache &registry = wasm::getIRModuleCache();
+
+        std::string user = "demo";
+        std::string funcA = "echo";
+        std::string funcB = "x2";
+        std::string path = "/usr/local/faasm/runtime_root/lib/python3.7/site-packages/numpy/core/multiarray.so";
+
+        IR::Module &refA = registry.getModule(user, funcA, path);
+        Runtime::ModuleRef objRefA = registry.getCompiledModule(user, funcA, path);
+        IR::Module &refB = registry.getModule(user, funcB, path);
+        Runtime::ModuleRef objRefB = registry.getCompiledModule(user, funcB, path);
+
+        // Both functions get the same copy
+        REQUIRE(std::addressof(refA) == std::addressof(refB));
+        REQUIRE(objRefA == objRefB);
+
+        // Table import must accept any main module's table
+        REQUIRE(refA.tables.imports[0].type.size.min == 0);
+        REQUIRE(refA.tables.imports[0].type.size.max == UINT64_MAX);
+
+        // Original size is still available
+        U64 tableSizeA = registry.getSharedModuleTableSize(user, funcA, path);
+        U64 tableSizeB = registry.getSharedModuleTableSize(user, funcB, path);
+        REQUIRE(tableSizeA > 0);
+        REQUIRE(tableSizeA == tableSizeB);
+    }
+
+    TEST_CASE("Test concurrent module loading", "[wasm]") {
+        wasm::IRModuleCache &registry = wasm::getIRModuleCache();
+
+        std::string user = "demo";
+        std::vector<std::string> funcs = {"echo", "x2", "dummy", "heap"};
+
+        // Several threads per function, all loading at once
+        int nThreadsPerFunc = 4;
+        std::vector<IR::Module *> modules(funcs.size() * nThreadsPerFunc);
+        std::vector<Runtime::ModuleRef> objRefs(funcs.size() * nThreadsPerFunc);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < modules.size(); i++) {
+            threads.emplace_back([&registry, &user, &funcs, &modules, &objRefs, nThreadsPerFunc, i] {
+                const std::string &func = funcs.at(i / nThreadsPerFunc);
+                modules.at(i) = &registry.getModule(user, func, "");
+                objRefs.at(i) = registry.getCompiledModule(user, func, "");
+            });
+        }
+
+        for (auto &t : threads) {
+            t.join();
+        }
+
+        // Each function must have been loaded exactly once
+        for (int i = 0; i < modules.size(); i++) {
+            int first = (i / nThreadsPerFunc) * nThreadsPerFunc;
+            REQUIRE(modules.at(i) == modules.at(first));
+            REQUIRE(objRefs.at(i) == objRefs.at(first));
+            REQUIRE(!modules.at(i)->exports.empty());
+
+            if (i != first) {
+                continue;
+            }
+
+            for (int j = 0; j < first; j += nThreadsPerFunc) {
+                REQUIRE(modules.at(i) != modules.at(j));
+                REQUIRE(objRefs.at(i) != objRefs.at(j));
+            }
+        }
+    }
+}
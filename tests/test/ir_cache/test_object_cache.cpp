@@ -0,0 +1,48 @@
+#include <catch/catch.hpp>
+
+#include <ir_cache/ObjectCache.h>
+
+#include <boost/filesystem.hpp>
+#include <cstring>
+
+namespace tests {
+    TEST_CASE("Test object cache keys", "[wasm]") {
+        std::vector<uint8_t> wasmA = {0, 'a', 's', 'm', 1, 0, 0, 0};
+        std::vector<uint8_t> wasmB = {0, 'a', 's', 'm', 1, 0, 0, 1};
+
+        std::string keyA = wasm::getObjectCacheKey(wasmA);
+        REQUIRE(keyA.size() == 64);
+        REQUIRE(keyA == wasm::getObjectCacheKey(wasmA));
+        REQUIRE(keyA != wasm::getObjectCacheKey(wasmB));
+    }
+
+    TEST_CASE("Test storing and loading from object cache", "[wasm]") {
+        std::string dir = "/tmp/faasm_test_object_cache";
+        boost::filesystem::remove_all(dir);
+
+        wasm::ObjectCache cache(dir);
+        REQUIRE(cache.isEnabled());
+
+        std::string key = wasm::getObjectCacheKey({0, 'a', 's', 'm', 1, 0, 0, 0});
+        REQUIRE(cache.load(key) == nullptr);
+
+        std::vector<uint8_t> objBytes(10000, 7);
+        objBytes[5000] = 3;
+        cache.store(key, objBytes);
+
+        std::shared_ptr<wasm::MappedObjectFile> loaded = cache.load(key);
+        REQUIRE(loaded != nullptr);
+        REQUIRE(loaded->size() == objBytes.size());
+        REQUIRE(memcmp(loaded->data(), objBytes.data(), objBytes.size()) == 0);
+
+        // Overwriting doesn't affect existing mappings
+        std::vector<uint8_t> otherBytes(20, 1);
+        cache.store(key, otherBytes);
+        REQUIRE(memcmp(loaded->data(), objBytes.data(), objBytes.size()) == 0);
+        REQUIRE(cache.load(key)->size() == otherBytes.size());
+
+        REQUIRE(!wasm::ObjectCache("").isEnabled());
+
+        boost::filesystem::remove_all(dir);
+    }
+}
@@ -1,9 +1,16 @@
 #include <catch/catch.hpp>
 #include "utils.h"
 
+#include <faabric/util/config.h>
 #include <faabric/util/func.h>
+#include <conf/FaasmConfig.h>
 #include <module_cache/WasmModuleCache.h>
 
+#include <WAVM/Runtime/Runtime.h>
+
+#include <cstring>
+
+using namespace WAVM;
 
 namespace tests {
     TEST_CASE("Test creating zygotes", "[zygote]") {
@@ -18,16 +25,264 @@ namespace tests {
         msgA.set_inputdata(BYTES(input), 3 * sizeof(int));
 
         module_cache::WasmModuleCache &registry = module_cache::getWasmModuleCache();
-        wasm::WasmModule &moduleA = registry.getCachedModule(msgA);
-        wasm::WasmModule &moduleB = registry.getCachedModule(msgB);
+        std::shared_ptr<wasm::WAVMWasmModule> moduleA = registry.getCachedModule(msgA);
+        std::shared_ptr<wasm::WAVMWasmModule> moduleB = registry.getCachedModule(msgB);
 
         // Check modules are the same
-        REQUIRE(std::addressof(moduleA) == std::addressof(moduleB));
-        REQUIRE(moduleA.isBound());
+        REQUIRE(moduleA.get() == moduleB.get());
+        REQUIRE(moduleA->isBound());
 
         // Execute the function normally and make sure zygote is not used directly
         faaslet::Faaslet faaslet = execFunction(msgA);
         REQUIRE(faaslet.isBound());
-        REQUIRE(std::addressof(moduleA) != std::addressof(*faaslet.module));
+        REQUIRE(moduleA.get() != faaslet.module.get());
+    }
+
+    TEST_CASE("Test zygote usage accounting", "[zygote]") {
+        cleanSystem();
+
+        faabric::Message msg = faabric::util::messageFactory("demo", "echo");
+
+        module_cache::WasmModuleCache &registry = module_cache::getWasmModuleCache();
+        REQUIRE(registry.getTotalCachedBytes() == 0);
+
+        std::shared_ptr<wasm::WAVMWasmModule> module = registry.getCachedModule(msg);
+        registry.getCachedModule(msg);
+
+        size_t memSize = Runtime::getMemoryNumPages(module->defaultMemory) * WASM_BYTES_PER_PAGE;
+        size_t expectedMemoryBytes = module->getPrivateMemoryBytes();
+        size_t expectedFdBytes = module->getMemoryFdAllocatedBytes();
+
+        // Zero pages are holes in the fd, so it takes up less than memory's virtual size
+        REQUIRE(expectedFdBytes > 0);
+        REQUIRE(expectedFdBytes < memSize);
+        REQUIRE(expectedMemoryBytes <= memSize);
+
+        module_cache::CachedModuleUsage usage = registry.getCachedModuleUsage(msg);
+        REQUIRE(usage.memoryBytes == expectedMemoryBytes);
+        REQUIRE(usage.fdBytes == expectedFdBytes);
+        REQUIRE(usage.hits == 2);
+        REQUIRE(registry.getTotalCachedBytes() == expectedMemoryBytes + expectedFdBytes);
+
+        registry.clear();
+        REQUIRE(registry.getTotalCachedBytes() == 0);
+    }
+
+    TEST_CASE("Test zygote eviction", "[zygote]") {
+        cleanSystem();
+
+        FaasmConfigGuard configGuard;
+        conf::FaasmConfig &conf = conf::getFaasmConfig();
+
+        faabric::Message msgA = faabric::util::messageFactory("demo", "echo");
+        faabric::Message msgB = faabric::util::messageFactory("demo", "dummy");
+        faabric::Message msgC = faabric::util::messageFactory("demo", "x2");
+
+        module_cache::WasmModuleCache &registry = module_cache::getWasmModuleCache();
+
+        conf.moduleCacheMaxMb = 0;
+        std::shared_ptr<wasm::WAVMWasmModule> moduleA = registry.getCachedModule(msgA);
+        registry.getCachedModule(msgB);
+        REQUIRE(registry.getTotalCachedModuleCount() == 2);
+
+        // Use A again so that B is the least recently used
+        registry.getCachedModule(msgA);
+
+        // Budget which only just fits the two modules. Only allocated memory is counted,
+        // so small modules may leave room for a few more.
+        size_t oneMb = 1024 * 1024;
+        int fullMb = (int) ((registry.getTotalCachedBytes() + oneMb - 1) / oneMb);
+
+        SECTION("Over budget") {
+            conf.moduleCacheMaxMb = 1;
+            registry.getCachedModule(msgC);
+
+            // The newest module survives, and the rest are evicted until under budget
+            REQUIRE(registry.isCached(msgC));
+            REQUIRE((registry.getTotalCachedBytes() <= oneMb || registry.getTotalCachedModuleCount() == 1));
+        }
+
+        SECTION("Evict least recently used") {
+            conf.moduleCacheMaxMb = fullMb;
+
+            // Keep adding modules until the budget forces something out
+            std::vector<std::string> otherFuncs = {"x2", "noop", "heap", "malloc", "memcpy", "sysconf", "uname",
+                                                   "getenv", "getcwd", "gettime", "fstat", "sizes"};
+            for (const auto &func : otherFuncs) {
+                faabric::Message msg = faabric::util::messageFactory("demo", func);
+                registry.getCachedModule(msg);
+                REQUIRE(registry.isCached(msg));
+
+                // A was used more recently, so can't go before B
+                if (!registry.isCached(msgA)) {
+                    REQUIRE(!registry.isCached(msgB));
+                }
+
+                if (!registry.isCached(msgB)) {
+                    break;
+                }
+            }
+
+            REQUIRE(!registry.isCached(msgB));
+            REQUIRE(registry.getTotalCachedBytes() <= ((size_t) fullMb) * oneMb);
+        }
+
+        SECTION("Unlimited") {
+            conf.moduleCacheMaxMb = 0;
+            registry.getCachedModule(msgC);
+            REQUIRE(registry.getTotalCachedModuleCount() == 3);
+        }
+
+        // Evicted module should still be usable by those holding it
+        wasm::WAVMWasmModule clone(*moduleA);
+        REQUIRE(clone.isBound());
+
+        cleanSystem();
+    }
+
+    TEST_CASE("Test building zygotes from incremental snapshots", "[zygote]") {
+        cleanSystem();
+
+        faabric::Message msg = faabric::util::messageFactory("demo", "echo");
+
+        module_cache::WasmModuleCache &registry = module_cache::getWasmModuleCache();
+        std::shared_ptr<wasm::WAVMWasmModule> zygote = registry.getCachedModule(msg);
+
+        wasm::WAVMWasmModule module(*zygote);
+        U8 *memBase = Runtime::getMemoryBaseAddress(module.defaultMemory);
+        Uptr memSize = Runtime::getMemoryNumPages(module.defaultMemory) * WASM_BYTES_PER_PAGE;
+        uint32_t offset = memSize - 2 * SNAPSHOT_CHUNK_SIZE;
+
+        // First snapshot is a full one
+        memBase[offset] = 1;
+        std::string keyA;
+        size_t sizeA = module.snapshotIncrementalToState("incremental_test", keyA);
+        REQUIRE(keyA == "incremental_test");
+
+        // Subsequent ones are deltas
+        memBase[offset] = 2;
+        std::string keyB;
+        size_t sizeB = module.snapshotIncrementalToState("incremental_test", keyB);
+        REQUIRE(keyB == "incremental_test#v1");
+        REQUIRE(sizeB < sizeA);
+
+        memBase[offset + 1] = 3;
+        std::string keyC;
+        size_t sizeC = module.snapshotIncrementalToState("incremental_test", keyC);
+        REQUIRE(keyC == "incremental_test#v2");
+
+        // Build the latest version straight away, which will need the earlier ones
+        faabric::Message msgC = msg;
+        msgC.set_snapshotkey(keyC);
+        msgC.set_snapshotsize(sizeC);
+
+        std::shared_ptr<wasm::WAVMWasmModule> moduleC = registry.getCachedModule(msgC);
+        U8 *memBaseC = Runtime::getMemoryBaseAddress(moduleC->defaultMemory);
+        REQUIRE(memBaseC[offset] == 2);
+        REQUIRE(memBaseC[offset + 1] == 3);
+        REQUIRE(std::memcmp(memBase, memBaseC, memSize) == 0);
+
+        faabric::Message msgB = msg;
+        msgB.set_snapshotkey(keyB);
+        REQUIRE(registry.isCached(msgB));
+
+        // Different base key starts again with a full snapshot
+        std::string keyD;
+        module.snapshotIncrementalToState("incremental_test_other", keyD);
+        REQUIRE(keyD == "incremental_test_other");
+    }
+
+    TEST_CASE("Test capturing hot zygote", "[zygote]") {
+        cleanSystem();
+
+        FaasmConfigGuard configGuard;
+        conf::FaasmConfig &conf = conf::getFaasmConfig();
+
+        faabric::Message msg = faabric::util::messageFactory("demo", "echo");
+        module_cache::WasmModuleCache &registry = module_cache::getWasmModuleCache();
+        std::shared_ptr<wasm::WAVMWasmModule> zygote = registry.getCachedModule(msg);
+
+        // Change some memory in a clone to stand in for lazy initialisation
+        wasm::WAVMWasmModule module(*zygote);
+        U8 *base = Runtime::getMemoryBaseAddress(module.defaultMemory);
+        Uptr offset = STACK_SIZE + 10;
+        U8 warmValue = base[offset] + 1;
+        base[offset] = warmValue;
+
+        SECTION("Disabled") {
+            conf.hotZygoteCalls = 0;
+            REQUIRE(!registry.recordSuccessfulCall(msg, module));
+            REQUIRE(registry.getCachedModule(msg).get() == zygote.get());
+        }
+
+        SECTION("Enabled") {
+            conf.hotZygoteCalls = 2;
+            REQUIRE(!registry.recordSuccessfulCall(msg, module));
+            REQUIRE(!registry.getCachedModuleUsage(msg).hot);
+
+            REQUIRE(registry.recordSuccessfulCall(msg, module));
+            REQUIRE(registry.getCachedModuleUsage(msg).hot);
+
+            // Only captured once
+            REQUIRE(!registry.recordSuccessfulCall(msg, module));
+
+            std::shared_ptr<wasm::WAVMWasmModule> hotZygote = registry.getCachedModule(msg);
+            REQUIRE(hotZygote.get() != zygote.get());
+            REQUIRE(Runtime::getMemoryBaseAddress(hotZygote->defaultMemory)[offset] == warmValue);
+            REQUIRE(Runtime::getMemoryBaseAddress(zygote->defaultMemory)[offset] != warmValue);
+
+            // Clones of the hot zygote start warm
+            wasm::WAVMWasmModule clone(*hotZygote);
+            REQUIRE(Runtime::getMemoryBaseAddress(clone.defaultMemory)[offset] == warmValue);
+
+            // Accounting is for the hot zygote only
+            size_t expectedBytes = Runtime::getMemoryNumPages(hotZygote->defaultMemory) * WASM_BYTES_PER_PAGE;
+            REQUIRE(registry.getTotalCachedBytes() == 2 * expectedBytes);
+        }
+    }
+
+    TEST_CASE("Test preloading dynamic modules into zygote", "[zygote]") {
+        cleanSystem();
+
+        FaasmConfigGuard configGuard;
+        conf::FaasmConfig &conf = conf::getFaasmConfig();
+
+        faabric::util::SystemConfig &sysConf = faabric::util::getSystemConfig();
+        ScopedOverride<std::string> pythonPreload(sysConf.pythonPreload, "off");
+
+        faabric::Message msg = faabric::util::messageFactory(PYTHON_USER, PYTHON_FUNC);
+        module_cache::WasmModuleCache &registry = module_cache::getWasmModuleCache();
+        std::shared_ptr<wasm::WAVMWasmModule> zygote = registry.getCachedModule(msg);
+        int zygoteModuleCount = zygote->getDynamicModuleCount();
+
+        // Load a library in a clone, as the function would
+        std::string path = sysConf.runtimeFilesDir + "/lib/python3.7/site-packages/numpy/core/multiarray.so";
+        wasm::WAVMWasmModule module(*zygote);
+        int handle = module.dynamicLoadModule(path, module.executionContext);
+
+        SECTION("Disabled") {
+            conf.preloadDynamicModules = "off";
+            REQUIRE(!registry.recordDynamicModules(msg, module));
+            REQUIRE(registry.getCachedModule(msg).get() == zygote.get());
+        }
+
+        SECTION("Enabled") {
+            conf.preloadDynamicModules = "on";
+            REQUIRE(registry.recordDynamicModules(msg, module));
+
+            // Nothing new to load second time round
+            REQUIRE(!registry.recordDynamicModules(msg, module));
+
+            std::shared_ptr<wasm::WAVMWasmModule> newZygote = registry.getCachedModule(msg);
+            REQUIRE(newZygote.get() != zygote.get());
+            REQUIRE(newZygote->getDynamicModuleCount() == zygoteModuleCount + 1);
+            REQUIRE(zygote->getDynamicModuleCount() == zygoteModuleCount);
+
+            // Clones get the same handle without loading again
+            wasm::WAVMWasmModule clone(*newZygote);
+            REQUIRE(clone.getDynamicModuleCount() == zygoteModuleCount + 1);
+            REQUIRE(clone.dynamicLoadModule(path, clone.executionContext) == handle);
+            REQUIRE(clone.getDynamicModuleCount() == zygoteModuleCount + 1);
+        }
     }
-}
\ No newline at end of file
+}
@@ -4,6 +4,7 @@
 #include <storage/LocalFileLoader.h>
 #include <boost/filesystem.hpp>
 #include <faabric/util/files.h>
+#include <faabric/util/func.h>
 
 using namespace storage;
 
@@ -27,4 +28,33 @@ namespace tests {
         const std::vector<uint8_t> actualBytes = faabric::util::readFileToBytes(fullPath.string());
         REQUIRE(actualBytes == expected);
     }
-}
\ No newline at end of file
+
+    TEST_CASE("Check codegen is skipped when unchanged", "[storage]") {
+        faabric::Message msg = faabric::util::messageFactory("demo", "echo");
+        storage::FileLoader &loader = storage::getFileLoader();
+
+        std::string objectFilePath = faabric::util::getFunctionObjectFile(msg);
+        std::string hashPath = objectFilePath + ".hash";
+        boost::filesystem::remove(hashPath);
+
+        // No hash yet so must generate
+        REQUIRE(loader.codegenForFunction(msg, true));
+        REQUIRE(boost::filesystem::exists(hashPath));
+
+        // Now up to date
+        REQUIRE(!loader.codegenForFunction(msg, true));
+
+        // Unless forced
+        REQUIRE(loader.codegenForFunction(msg, false));
+
+        // Or the hash doesn't match
+        std::vector<uint8_t> wasmBytes = loader.loadFunctionWasm(msg);
+        std::string hash = storage::getCodegenHash(wasmBytes);
+        REQUIRE(storage::isCodegenUpToDate(objectFilePath, hash));
+
+        faabric::util::writeBytesToFile(hashPath, {'x'});
+        REQUIRE(!storage::isCodegenUpToDate(objectFilePath, hash));
+        REQUIRE(loader.codegenForFunction(msg, true));
+        REQUIRE(storage::isCodegenUpToDate(objectFilePath, hash));
+    }
+}
@@ -20,4 +20,19 @@ namespace tests {
         std::string outputData = call.outputdata();
         REQUIRE(outputData == inputData);
     }
-}
+
+    TEST_CASE("Test executing echo function in WAMR interpreter", "[wasm]") {
+        faabric::Message call = faabric::util::messageFactory("demo", "echo");
+        std::string inputData = "hello interpreter";
+        call.set_inputdata(inputData);
+
+        wasm::WAMRWasmModule module;
+        module.bindToFunctionInterpreted(call);
+
+        bool success = module.execute(call);
+        REQUIRE(success);
+
+        std::string outputData = call.outputdata();
+        REQUIRE(outputData == inputData);
+    }
+}
\ No newline at end of file
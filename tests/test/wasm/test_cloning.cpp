@@ -1,9 +1,18 @@
 #include <catch/catch.hpp>
+#include "utils.h"
+
+#include <conf/FaasmConfig.h>
 #include <wavm/WAVMWasmModule.h>
+#include <module_cache/WasmModuleCache.h>
 #include <faabric/util/func.h>
 #include <faabric/util/config.h>
 #include <WAVM/Runtime/Intrinsics.h>
 
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 using namespace wasm;
 using namespace WAVM;
 
@@ -269,4 +278,223 @@ namespace tests {
         REQUIRE(moduleB.tearDown());
         REQUIRE(moduleC.tearDown());
     }
+
+    TEST_CASE("Test resetting dirty pages from zygote", "[wasm]") {
+        cleanSystem();
+
+        faabric::Message msg = faabric::util::messageFactory("demo", "echo");
+        module_cache::WasmModuleCache &registry = module_cache::getWasmModuleCache();
+        std::shared_ptr<WAVMWasmModule> zygotePtr = registry.getCachedModule(msg);
+        WAVMWasmModule &zygote = *zygotePtr;
+
+        WAVMWasmModule module(zygote);
+
+        // Write to a couple of pages in the clone
+        U8 *zygoteBase = Runtime::getMemoryBaseAddress(zygote.defaultMemory);
+        U8 *base = Runtime::getMemoryBaseAddress(module.defaultMemory);
+        Uptr memSize = Runtime::getMemoryNumPages(module.defaultMemory) * WASM_BYTES_PER_PAGE;
+
+        std::vector<Uptr> offsets = {STACK_SIZE + 10, memSize - 100};
+        std::vector<U8> original;
+        for (auto o : offsets) {
+            original.emplace_back(zygoteBase[o]);
+            base[o] = zygoteBase[o] + 1;
+        }
+
+        SECTION("Unchanged layout") {
+            REQUIRE(module.resetDirtyPages(zygote));
+
+            for (int i = 0; i < offsets.size(); i++) {
+                REQUIRE(base[offsets.at(i)] == original.at(i));
+                REQUIRE(zygoteBase[offsets.at(i)] == original.at(i));
+            }
+        }
+
+        SECTION("Grown memory") {
+            module.mmapPages(1);
+            REQUIRE(!module.resetDirtyPages(zygote));
+        }
+
+        SECTION("Unrelated module") {
+            WAVMWasmModule other;
+            other.bindToFunction(msg);
+            REQUIRE(!other.resetDirtyPages(zygote));
+        }
+    }
+
+    TEST_CASE("Test resetting dirty pages with huge pages", "[wasm]") {
+        cleanSystem();
+
+        FaasmConfigGuard configGuard;
+        conf::FaasmConfig &conf = conf::getFaasmConfig();
+
+        SECTION("Global") {
+            conf.hugePages = "on";
+        }
+
+        SECTION("Per function") {
+            setenv("HUGE_PAGES_FUNCTIONS", "demo/x2,demo/echo", 1);
+            conf.reset();
+            unsetenv("HUGE_PAGES_FUNCTIONS");
+
+            REQUIRE(!conf.useHugePages("demo", "hello"));
+        }
+
+        REQUIRE(conf.useHugePages("demo", "echo"));
+
+        faabric::Message msg = faabric::util::messageFactory("demo", "echo");
+        module_cache::WasmModuleCache &registry = module_cache::getWasmModuleCache();
+        std::shared_ptr<WAVMWasmModule> zygotePtr = registry.getCachedModule(msg);
+        WAVMWasmModule &zygote = *zygotePtr;
+
+        WAVMWasmModule module(zygote);
+
+        // Write to pages at both ends of memory
+        U8 *zygoteBase = Runtime::getMemoryBaseAddress(zygote.defaultMemory);
+        U8 *base = Runtime::getMemoryBaseAddress(module.defaultMemory);
+        Uptr memSize = Runtime::getMemoryNumPages(module.defaultMemory) * WASM_BYTES_PER_PAGE;
+
+        U8 original = zygoteBase[STACK_SIZE + 10];
+        base[STACK_SIZE + 10] = original + 1;
+        base[memSize - 100] = 5;
+
+        REQUIRE(module.resetDirtyPages(zygote));
+        REQUIRE(base[STACK_SIZE + 10] == original);
+        REQUIRE(base[memSize - 100] == zygoteBase[memSize - 100]);
+
+        // Clones still run
+        REQUIRE(module.execute(msg));
+    }
+
+    TEST_CASE("Test merging memory diffs between clones", "[wasm]") {
+        cleanSystem();
+
+        faabric::Message msg = faabric::util::messageFactory("demo", "echo");
+        module_cache::WasmModuleCache &registry = module_cache::getWasmModuleCache();
+        std::shared_ptr<WAVMWasmModule> zygotePtr = registry.getCachedModule(msg);
+        WAVMWasmModule &zygote = *zygotePtr;
+
+        WAVMWasmModule parent(zygote);
+        WAVMWasmModule threadA(zygote);
+        WAVMWasmModule threadB(zygote);
+
+        U8 *zygoteBase = Runtime::getMemoryBaseAddress(zygote.defaultMemory);
+        U8 *parentBase = Runtime::getMemoryBaseAddress(parent.defaultMemory);
+        U8 *baseA = Runtime::getMemoryBaseAddress(threadA.defaultMemory);
+        U8 *baseB = Runtime::getMemoryBaseAddress(threadB.defaultMemory);
+
+        // Threads write adjacent bytes on the same page, plus the stack which is excluded
+        Uptr offset = STACK_SIZE + 100;
+        baseA[offset] = zygoteBase[offset] + 1;
+        baseB[offset + 1] = zygoteBase[offset + 1] + 2;
+        baseA[10] = zygoteBase[10] + 1;
+
+        // Parent writes its own byte on the same page
+        parentBase[offset + 2] = zygoteBase[offset + 2] + 3;
+
+        Uptr memSize = Runtime::getMemoryNumPages(zygote.defaultMemory) * WASM_BYTES_PER_PAGE;
+        bool grow = false;
+        SECTION("Same size") {
+        }
+
+        SECTION("Thread grows memory") {
+            grow = true;
+            threadB.mmapPages(1);
+            baseB = Runtime::getMemoryBaseAddress(threadB.defaultMemory);
+            baseB[memSize + 5] = 7;
+        }
+
+        std::vector<uint8_t> diffA = threadA.getMemoryDiff(zygote, STACK_SIZE);
+        std::vector<uint8_t> diffB = threadB.getMemoryDiff(zygote, STACK_SIZE);
+
+        parent.applyMemoryDiff(diffA.data(), diffA.size());
+        parent.applyMemoryDiff(diffB.data(), diffB.size());
+        parentBase = Runtime::getMemoryBaseAddress(parent.defaultMemory);
+
+        REQUIRE(parentBase[offset] == (U8) (zygoteBase[offset] + 1));
+        REQUIRE(parentBase[offset + 1] == (U8) (zygoteBase[offset + 1] + 2));
+        REQUIRE(parentBase[offset + 2] == (U8) (zygoteBase[offset + 2] + 3));
+        REQUIRE(parentBase[10] == zygoteBase[10]);
+
+        if (grow) {
+            REQUIRE(Runtime::getMemoryNumPages(parent.defaultMemory) == memSize / WASM_BYTES_PER_PAGE + 1);
+            REQUIRE(parentBase[memSize + 5] == 7);
+        }
+    }
+
+    TEST_CASE("Test merging thread writes to parent's stack", "[wasm]") {
+        cleanSystem();
+
+        faabric::Message msg = faabric::util::messageFactory("demo", "echo");
+        module_cache::WasmModuleCache &registry = module_cache::getWasmModuleCache();
+        std::shared_ptr<WAVMWasmModule> zygote = registry.getCachedModule(msg);
+
+        // Parent snapshots part way down its stack
+        WAVMWasmModule parent(*zygote);
+        U8 *parentBase = Runtime::getMemoryBaseAddress(parent.defaultMemory);
+        uint32_t parentStackPointer = STACK_SIZE - (4 * SNAPSHOT_CHUNK_SIZE);
+        Uptr bufferOffset = parentStackPointer + 100;
+        parentBase[bufferOffset] = 1;
+
+        std::string snapshotKey;
+        size_t snapshotSize = parent.snapshotIncrementalToState("thread_stack_test", snapshotKey,
+                                                                parentStackPointer);
+
+        faabric::Message threadMsg = msg;
+        threadMsg.set_snapshotkey(snapshotKey);
+        threadMsg.set_snapshotsize(snapshotSize);
+        std::shared_ptr<WAVMWasmModule> threadZygote = registry.getCachedModule(threadMsg);
+        REQUIRE(threadZygote->getStackPointer() == parentStackPointer);
+
+        // Thread writes to the parent's buffer, and to its own frames below the stack pointer
+        WAVMWasmModule thread(*threadZygote);
+        U8 *threadBase = Runtime::getMemoryBaseAddress(thread.defaultMemory);
+        REQUIRE(threadBase[bufferOffset] == 1);
+        threadBase[bufferOffset] = 2;
+
+        Uptr frameOffset = parentStackPointer - 100;
+        threadBase[frameOffset] = parentBase[frameOffset] + 1;
+
+        std::vector<uint8_t> diff = thread.getMemoryDiff(*threadZygote, threadZygote->getStackPointer());
+        U8 originalFrame = parentBase[frameOffset];
+        parent.applyMemoryDiff(diff.data(), diff.size());
+        parentBase = Runtime::getMemoryBaseAddress(parent.defaultMemory);
+
+        REQUIRE(parentBase[bufferOffset] == 2);
+        REQUIRE(parentBase[frameOffset] == originalFrame);
+    }
+
+    TEST_CASE("Test writing sparse memory to fd", "[wasm]") {
+        cleanSystem();
+
+        faabric::Message msg = faabric::util::messageFactory("demo", "echo");
+
+        WAVMWasmModule module;
+        module.bindToFunction(msg);
+
+        // Grow memory so there are definitely untouched pages at the end
+        U32 newPagesStart = module.mmapPages(10);
+        U8 *base = Runtime::getMemoryBaseAddress(module.defaultMemory);
+        base[newPagesStart + 100] = 5;
+
+        int fd = memfd_create("sparse_test", 0);
+        module.writeMemoryToFd(fd);
+
+        Uptr memSize = Runtime::getMemoryNumPages(module.defaultMemory) * WASM_BYTES_PER_PAGE;
+        REQUIRE(module.getMemoryFdSize() == memSize);
+
+        // Zero pages are left as holes
+        struct stat fdStat{};
+        fstat(fd, &fdStat);
+        REQUIRE(fdStat.st_size == memSize);
+        REQUIRE(fdStat.st_blocks * 512 < memSize);
+
+        // Clones still see the same memory
+        WAVMWasmModule clone(module);
+        U8 *cloneBase = Runtime::getMemoryBaseAddress(clone.defaultMemory);
+        REQUIRE(memcmp(base, cloneBase, memSize) == 0);
+        REQUIRE(cloneBase[newPagesStart + 100] == 5);
+
+        close(fd);
+    }
 }
@@ -102,10 +102,15 @@ namespace tests {
         // Check we can't load an invalid function
         REQUIRE_THROWS(module.getDynamicModuleFunction(handleA, "foo"));
 
-        // Load a valid function and check table grows to fit it
-        module.getDynamicModuleFunction(handleA, funcA);
+        // Load a valid function, already in the table from the module's elements
+        uint32_t funcAIdx = module.getDynamicModuleFunction(handleA, funcA);
+        REQUIRE(funcAIdx == module.getFunctionOffsetFromGOT(funcA));
         int tableSizeAfterAFunc = Runtime::getTableNumElements(module.defaultTable);
-        REQUIRE(tableSizeAfterAFunc == tableSizeAfterA + 1);
+        REQUIRE(tableSizeAfterAFunc == tableSizeAfterA);
+
+        // Looking it up again gives the same slot
+        REQUIRE(module.getDynamicModuleFunction(handleA, funcA) == funcAIdx);
+        REQUIRE(Runtime::getTableNumElements(module.defaultTable) == tableSizeAfterAFunc);
 
         // --- Module Two ---
         std::string modulePathB = getPythonModuleB();
@@ -136,9 +141,16 @@ namespace tests {
         REQUIRE_THROWS(module.getDynamicModuleFunction(handleB, "bar"));
 
         // Check a valid function
-        module.getDynamicModuleFunction(handleB, funcB);
+        uint32_t funcBIdx = module.getDynamicModuleFunction(handleB, funcB);
+        REQUIRE(funcBIdx == module.getFunctionOffsetFromGOT(funcB));
         Uptr numElemsAfterB = Runtime::getTableNumElements(module.defaultTable);
-        REQUIRE(numElemsAfterB == tableSizeAfterB + 1);
+        REQUIRE(numElemsAfterB == tableSizeAfterB);
+
+        // Closing the modules keeps the handles valid
+        REQUIRE(module.dynamicUnloadModule(handleA));
+        REQUIRE(module.dynamicUnloadModule(handleB));
+        REQUIRE(!module.dynamicUnloadModule(handleB));
+        REQUIRE(module.dynamicLoadModule(modulePathA, module.executionContext) == handleA);
 
         conf.pythonPreload = preloadBefore;
     }
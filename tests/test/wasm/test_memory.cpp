@@ -1,9 +1,14 @@
 #include <catch/catch.hpp>
+#include "utils.h"
+
 #include <wavm/WAVMWasmModule.h>
 #include <faabric/util/bytes.h>
 #include <faabric/util/func.h>
+#include <faabric/util/memory.h>
 #include <faabric/util/config.h>
+#include <conf/FaasmConfig.h>
 
+#include <algorithm>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -48,4 +53,204 @@ namespace tests {
         // Check the bytes match
         REQUIRE(expected == actual);
     }
+
+    TEST_CASE("Test munmapped memory is reused", "[wasm]") {
+        faabric::Message call = faabric::util::messageFactory("demo", "echo");
+
+        wasm::WAVMWasmModule module;
+        module.bindToFunction(call);
+
+        U32 pageSize = WASM_BYTES_PER_PAGE;
+        U32 ptrA = module.mmapMemory(3 * pageSize);
+        U32 ptrB = module.mmapMemory(pageSize);
+        U32 ptrC = module.mmapMemory(2 * pageSize);
+        Uptr pagesBefore = Runtime::getMemoryNumPages(module.defaultMemory);
+
+        U8 *base = Runtime::getMemoryBaseAddress(module.defaultMemory);
+        std::fill(base + ptrA, base + ptrA + (3 * pageSize), 5);
+
+        // Invalid unmaps
+        REQUIRE(module.munmapMemory(ptrA + 10, pageSize) == -EINVAL);
+        REQUIRE(module.munmapMemory(ptrA, 0) == -EINVAL);
+
+        // Memory the module started with wasn't mapped
+        REQUIRE(module.munmapMemory(0, pageSize) == -EINVAL);
+
+        // Unmap and remap a smaller range, should get the smallest fit
+        REQUIRE(module.munmapMemory(ptrA, 3 * pageSize) == 0);
+        REQUIRE(module.munmapMemory(ptrC, 2 * pageSize) == 0);
+        REQUIRE(module.getFreeMemoryBytes() == 5 * pageSize);
+
+        U32 ptrD = module.mmapMemory(pageSize + 10);
+        REQUIRE(ptrD == ptrC);
+        REQUIRE(module.getFreeMemoryBytes() == 3 * pageSize);
+
+        // Reused memory is zeroed
+        U32 ptrE = module.mmapMemory(pageSize);
+        REQUIRE(ptrE == ptrA);
+        REQUIRE(base[ptrE] == 0);
+        REQUIRE(base[ptrE + pageSize - 1] == 0);
+        REQUIRE(Runtime::getMemoryNumPages(module.defaultMemory) == pagesBefore);
+
+        // Adjacent free ranges are merged
+        REQUIRE(module.munmapMemory(ptrE, pageSize) == 0);
+        REQUIRE(module.munmapMemory(ptrB, pageSize) == 0);
+        U32 ptrF = module.mmapMemory(4 * pageSize);
+        REQUIRE(ptrF == ptrA);
+        REQUIRE(module.getFreeMemoryBytes() == 0);
+        REQUIRE(Runtime::getMemoryNumPages(module.defaultMemory) == pagesBefore);
+    }
+
+    TEST_CASE("Test restoring a snapshot drops free memory", "[wasm]") {
+        faabric::Message call = faabric::util::messageFactory("demo", "echo");
+
+        wasm::WAVMWasmModule module;
+        module.bindToFunction(call);
+
+        std::string filePath = "/tmp/faasm_free_memory_snapshot";
+        module.snapshotToFile(filePath);
+
+        // Free some memory and a stack after the snapshot
+        U32 pageSize = WASM_BYTES_PER_PAGE;
+        U32 ptr = module.mmapMemory(2 * pageSize);
+        REQUIRE(module.munmapMemory(ptr, pageSize) == 0);
+        module.releaseThreadStack(module.allocateThreadStack());
+
+        REQUIRE(module.getFreeMemoryBytes() > 0);
+        REQUIRE(module.getFreeThreadStackCount() == 1);
+
+        // The snapshot knows nothing of them, so they mustn't be handed out again
+        module.restoreFromFile(filePath);
+        REQUIRE(module.getFreeMemoryBytes() == 0);
+        REQUIRE(module.getFreeThreadStackCount() == 0);
+    }
+
+    TEST_CASE("Test madvise discards memory", "[wasm]") {
+        faabric::Message call = faabric::util::messageFactory("demo", "echo");
+
+        wasm::WAVMWasmModule module;
+        module.bindToFunction(call);
+
+        U32 pageSize = WASM_BYTES_PER_PAGE;
+        U32 ptr = module.mmapMemory(2 * pageSize);
+        U8 *base = Runtime::getMemoryBaseAddress(module.defaultMemory);
+        std::fill(base + ptr, base + ptr + (2 * pageSize), 3);
+
+        // Other advice is ignored
+        REQUIRE(module.adviseMemory(ptr, pageSize, MADV_WILLNEED) == 0);
+        REQUIRE(base[ptr] == 3);
+
+        // Out of bounds
+        U32 memSize = Runtime::getMemoryNumPages(module.defaultMemory) * pageSize;
+        REQUIRE(module.adviseMemory(memSize - pageSize, 2 * pageSize, MADV_DONTNEED) == -EINVAL);
+
+        // Only whole host pages in the range are dropped
+        REQUIRE(module.adviseMemory(ptr + 1, pageSize, MADV_DONTNEED) == 0);
+        REQUIRE(base[ptr] == 3);
+        REQUIRE(base[ptr + faabric::util::HOST_PAGE_SIZE] == 0);
+        REQUIRE(base[ptr + pageSize - 1] == 0);
+        REQUIRE(base[ptr + pageSize] == 3);
+
+        REQUIRE(module.adviseMemory(ptr + pageSize, pageSize, MADV_FREE) == 0);
+        REQUIRE(base[ptr + pageSize] == 0);
+        REQUIRE(base[ptr + (2 * pageSize) - 1] == 0);
+    }
+
+    TEST_CASE("Test thread stacks are pooled", "[wasm]") {
+        conf::FaasmConfig &conf = conf::getFaasmConfig();
+
+        // Override rounded up to whole wasm pages
+        setenv("THREAD_STACK_KB_OVERRIDES", "demo/foo:16,demo/echo:100", 1);
+        conf.reset();
+        REQUIRE(conf.getThreadStackKb("demo", "echo") == 100);
+        REQUIRE(conf.getThreadStackKb("demo", "x2") == conf.threadStackKb);
+
+        faabric::Message call = faabric::util::messageFactory("demo", "echo");
+        wasm::WAVMWasmModule module;
+        module.bindToFunction(call);
+        REQUIRE(module.getThreadStackSize() == 2 * WASM_BYTES_PER_PAGE);
+
+        Uptr pagesBefore = Runtime::getMemoryNumPages(module.defaultMemory);
+        U32 stackA = module.allocateThreadStack();
+        U32 stackB = module.allocateThreadStack();
+        REQUIRE(stackA != stackB);
+        REQUIRE(Runtime::getMemoryNumPages(module.defaultMemory) == pagesBefore + 4);
+
+        // Released stacks are reused rather than growing memory
+        module.releaseThreadStack(stackA);
+        REQUIRE(module.getFreeThreadStackCount() == 1);
+        REQUIRE(module.allocateThreadStack() == stackA);
+
+        module.releaseThreadStack(stackA);
+        module.releaseThreadStack(stackB);
+        for (int i = 0; i < 10; i++) {
+            U32 stack = module.allocateThreadStack();
+            module.releaseThreadStack(stack);
+        }
+
+        REQUIRE(module.getFreeThreadStackCount() == 2);
+        REQUIRE(Runtime::getMemoryNumPages(module.defaultMemory) == pagesBefore + 4);
+
+        // Clones get their own copy of the pool
+        wasm::WAVMWasmModule moduleCopy(module);
+        REQUIRE(moduleCopy.getFreeThreadStackCount() == 2);
+        moduleCopy.allocateThreadStack();
+        REQUIRE(moduleCopy.getFreeThreadStackCount() == 1);
+        REQUIRE(module.getFreeThreadStackCount() == 2);
+
+        unsetenv("THREAD_STACK_KB_OVERRIDES");
+        conf.reset();
+    }
+
+    TEST_CASE("Test memory growth is reserved ahead of mmap", "[wasm]") {
+        FaasmConfigGuard configGuard;
+        conf::FaasmConfig &conf = conf::getFaasmConfig();
+
+        faabric::Message call = faabric::util::messageFactory("demo", "echo");
+        wasm::WAVMWasmModule module;
+        module.bindToFunction(call);
+
+        U32 pageSize = WASM_BYTES_PER_PAGE;
+        Uptr pagesBefore = Runtime::getMemoryNumPages(module.defaultMemory);
+        REQUIRE(module.getMemoryBreak() == pagesBefore * pageSize);
+
+        Uptr expectedReserve = 0;
+        SECTION("No reserve") {
+            conf.memoryReservePercent = 0;
+        }
+
+        SECTION("With reserve") {
+            conf.memoryReservePercent = 50;
+            expectedReserve = pagesBefore / 2;
+        }
+
+        // First mapping grows by the reserve on top of what's needed
+        U32 ptrA = module.mmapPages(1);
+        REQUIRE(ptrA == pagesBefore * pageSize);
+        REQUIRE(module.getMemoryBreak() == ptrA + pageSize);
+        REQUIRE(Runtime::getMemoryNumPages(module.defaultMemory) == pagesBefore + 1 + expectedReserve);
+
+        // Later mappings are contiguous, and only grow once the reserve is used up
+        U32 ptrB = module.mmapPages(1);
+        REQUIRE(ptrB == ptrA + pageSize);
+        REQUIRE(module.getMemoryBreak() == ptrB + pageSize);
+        if (expectedReserve > 0) {
+            REQUIRE(Runtime::getMemoryNumPages(module.defaultMemory) == pagesBefore + 1 + expectedReserve);
+        } else {
+            REQUIRE(Runtime::getMemoryNumPages(module.defaultMemory) == pagesBefore + 2);
+        }
+
+        // Reserved pages can't be unmapped
+        if (expectedReserve > 1) {
+            REQUIRE(module.munmapMemory(ptrB + pageSize, pageSize) == -EINVAL);
+        }
+
+        // Growing memory directly moves the break past it, freeing the rest of the reserve
+        Uptr breakPages = module.getMemoryBreak() / pageSize;
+        Uptr pagesNow = Runtime::getMemoryNumPages(module.defaultMemory);
+        Uptr prevPages;
+        Runtime::growMemory(module.defaultMemory, 1, &prevPages);
+        REQUIRE(module.getMemoryBreak() == (pagesNow + 1) * pageSize);
+        REQUIRE(module.getFreeMemoryBytes() == (pagesNow - breakPages) * pageSize);
+    }
 }
@@ -1,11 +1,15 @@
 #include <catch/catch.hpp>
 
 #include <wavm/WAVMWasmModule.h>
+#include <wasm/serialisation.h>
 #include <boost/filesystem.hpp>
+#include <cstring>
 #include <faabric/util/func.h>
+#include <faabric/util/memory.h>
 #include "utils.h"
 
 using namespace wasm;
+using namespace WAVM;
 
 namespace tests {
     TEST_CASE("Test serializing and restoring module", "[wasm]") {
@@ -28,6 +32,10 @@ namespace tests {
             mode = "state";
         }
 
+        SECTION("In mappable file") {
+            mode = "mappable";
+        }
+
         std::vector<uint8_t> memoryData;
 
         std::string stateKey = "serialTest";
@@ -49,6 +57,9 @@ namespace tests {
         } else if (mode == "file") {
             // Serialise to file
             moduleA.snapshotToFile(filePath);
+        } else if (mode == "mappable") {
+            // Serialise to a file which can be mapped back in
+            moduleA.snapshotToMappableFile(filePath);
         } else {
             // Serialise to state
             stateSize = moduleA.snapshotToState(stateKey);
@@ -61,7 +72,7 @@ namespace tests {
         // Restore from cross-host data
         if (mode == "memory") {
             moduleB.restoreFromMemory(memoryData);
-        } else if (mode == "file") {
+        } else if (mode == "file" || mode == "mappable") {
             moduleB.restoreFromFile(filePath);
         } else {
             moduleB.restoreFromState(stateKey, stateSize);
@@ -74,4 +85,135 @@ namespace tests {
         bool successB = moduleB.execute(m);
         REQUIRE(successB);
     }
+
+    TEST_CASE("Test snapshot elides zero and duplicate pages", "[wasm]") {
+        cleanSystem();
+
+        faabric::Message m = faabric::util::messageFactory("demo", "zygote_check");
+
+        wasm::WAVMWasmModule moduleA;
+        moduleA.bindToFunction(m);
+
+        // Grow memory, leaving the new pages zeroed apart from two identical chunks
+        uint32_t offset = moduleA.mmapPages(4);
+        U8 *baseA = Runtime::getMemoryBaseAddress(moduleA.defaultMemory);
+        Uptr numPagesA = Runtime::getMemoryNumPages(moduleA.defaultMemory);
+        std::memset(baseA + offset, 5, SNAPSHOT_CHUNK_SIZE);
+        std::memset(baseA + offset + 8 * SNAPSHOT_CHUNK_SIZE, 5, SNAPSHOT_CHUNK_SIZE);
+
+        std::vector<uint8_t> snapData = moduleA.snapshotToMemory();
+        REQUIRE(snapData.size() < numPagesA * WASM_BYTES_PER_PAGE);
+
+        // Restore into a module with junk in the region that should be zero
+        wasm::WAVMWasmModule moduleB;
+        moduleB.bindToFunction(m);
+        uint32_t offsetB = moduleB.mmapPages(4);
+        REQUIRE(offsetB == offset);
+
+        U8 *baseB = Runtime::getMemoryBaseAddress(moduleB.defaultMemory);
+        std::memset(baseB + offset + 2 * SNAPSHOT_CHUNK_SIZE, 3, SNAPSHOT_CHUNK_SIZE);
+
+        moduleB.restoreFromMemory(snapData);
+
+        Uptr numPagesB = Runtime::getMemoryNumPages(moduleB.defaultMemory);
+        REQUIRE(numPagesB == numPagesA);
+
+        Uptr memSize = numPagesA * WASM_BYTES_PER_PAGE;
+        REQUIRE(std::memcmp(baseA, baseB, memSize) == 0);
+    }
+
+    TEST_CASE("Test snapshot to and from caller buffer", "[wasm]") {
+        cleanSystem();
+
+        faabric::Message m = faabric::util::messageFactory("demo", "zygote_check");
+
+        wasm::WAVMWasmModule moduleA;
+        moduleA.bindToFunction(m);
+
+        std::vector<uint8_t> expected = moduleA.snapshotToMemory();
+
+        // Buffer too small
+        std::vector<uint8_t> smallBuffer(expected.size() - 1);
+        REQUIRE_THROWS(moduleA.snapshotToMemory(smallBuffer.data(), smallBuffer.size()));
+
+        // Buffer with room to spare
+        std::vector<uint8_t> buffer(expected.size() + 100, 0);
+        size_t written = moduleA.snapshotToMemory(buffer.data(), buffer.size());
+        REQUIRE(written == expected.size());
+        REQUIRE(std::equal(expected.begin(), expected.end(), buffer.begin()));
+
+        // Restore from the buffer directly
+        wasm::WAVMWasmModule moduleB;
+        moduleB.bindToFunctionNoZygote(m);
+        moduleB.restoreFromMemory(buffer.data(), written);
+
+        REQUIRE(moduleB.execute(m));
+    }
+
+    TEST_CASE("Test restoring mappable snapshot is copy-on-write", "[wasm]") {
+        cleanSystem();
+
+        faabric::Message m = faabric::util::messageFactory("demo", "zygote_check");
+
+        std::string filePath = "/tmp/faasm_serialised_mappable";
+        if (boost::filesystem::exists(filePath.c_str())) {
+            boost::filesystem::remove(filePath.c_str());
+        }
+
+        wasm::WAVMWasmModule moduleA;
+        moduleA.bindToFunction(m);
+
+        uint32_t offset = moduleA.mmapPages(2);
+        U8 *baseA = Runtime::getMemoryBaseAddress(moduleA.defaultMemory);
+        std::memset(baseA + offset, 7, 100);
+
+        moduleA.snapshotToMappableFile(filePath);
+
+        // Zero pages should be holes, so the file uses less space than its size
+        Uptr memSize = Runtime::getMemoryNumPages(moduleA.defaultMemory) * WASM_BYTES_PER_PAGE;
+        REQUIRE(boost::filesystem::file_size(filePath) == memSize + faabric::util::HOST_PAGE_SIZE);
+
+        wasm::WAVMWasmModule moduleB;
+        moduleB.bindToFunctionNoZygote(m);
+        moduleB.restoreFromFile(filePath);
+
+        U8 *baseB = Runtime::getMemoryBaseAddress(moduleB.defaultMemory);
+        REQUIRE(std::memcmp(baseA, baseB, memSize) == 0);
+
+        // Writing to the restored memory mustn't change the file
+        baseB[offset] = 9;
+
+        wasm::WAVMWasmModule moduleC;
+        moduleC.bindToFunctionNoZygote(m);
+        moduleC.restoreFromFile(filePath);
+
+        U8 *baseC = Runtime::getMemoryBaseAddress(moduleC.defaultMemory);
+        REQUIRE(baseC[offset] == 7);
+
+        // A truncated snapshot is rejected rather than mapped
+        boost::filesystem::resize_file(filePath, memSize);
+
+        wasm::WAVMWasmModule moduleD;
+        moduleD.bindToFunctionNoZygote(m);
+        REQUIRE_THROWS(moduleD.restoreFromFile(filePath));
+    }
+
+    TEST_CASE("Test parsing versioned snapshot keys", "[wasm]") {
+        std::string baseKey;
+        int version = 0;
+
+        std::string versionedKey = getVersionedSnapshotKey("foo", 3);
+        REQUIRE(parseVersionedSnapshotKey(versionedKey, baseKey, version));
+        REQUIRE(baseKey == "foo");
+        REQUIRE(version == 3);
+
+        // Base keys, and user keys which just look versioned, aren't deltas
+        REQUIRE(getVersionedSnapshotKey("foo", 0) == "foo");
+        REQUIRE(!parseVersionedSnapshotKey("foo", baseKey, version));
+        REQUIRE(!parseVersionedSnapshotKey("model_v2", baseKey, version));
+
+        // Base keys can't contain the separator
+        REQUIRE_THROWS(getVersionedSnapshotKey("foo#v1", 2));
+        REQUIRE_THROWS(getSnapshotDeltaKey("foo#bar", 1));
+    }
 }
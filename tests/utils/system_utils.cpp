@@ -11,6 +11,8 @@ extern "C" {
 #include <emulator/emulator.h>
 #include <module_cache/WasmModuleCache.h>
 
+#include <cstdlib>
+
 namespace tests {
     void cleanSystem() {
         // Faabric stuff
@@ -26,4 +28,17 @@ namespace tests {
         resetEmulator();
         setEmulatorUser("tester");
     }
-}
\ No newline at end of file
+
+    FaasmConfigGuard::FaasmConfigGuard(std::vector<std::string> envVarsIn) : original(conf::getFaasmConfig()),
+                                                                            envVars(std::move(envVarsIn)) {
+
+    }
+
+    FaasmConfigGuard::~FaasmConfigGuard() {
+        for (const auto &envVar : envVars) {
+            unsetenv(envVar.c_str());
+        }
+
+        conf::getFaasmConfig() = original;
+    }
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <conf/FaasmConfig.h>
 #include <faabric/util/func.h>
 #include <faaslet/FaasletPool.h>
 #include <faaslet/Faaslet.h>
@@ -12,6 +13,41 @@ using namespace faasm;
 namespace tests {
     void cleanSystem();
 
+    /**
+     * Puts the Faasm config back as it was when this goes out of scope, so a test that
+     * changes it can't leak its changes into later tests by failing part way through.
+     * Any environment variables given are unset first.
+     */
+    class FaasmConfigGuard {
+    public:
+        explicit FaasmConfigGuard(std::vector<std::string> envVarsIn = {});
+
+        ~FaasmConfigGuard();
+
+    private:
+        conf::FaasmConfig original;
+        std::vector<std::string> envVars;
+    };
+
+    /**
+     * Overrides a single value (e.g. a system config field) until the end of the scope.
+     */
+    template<typename T>
+    class ScopedOverride {
+    public:
+        ScopedOverride(T &valueIn, T overrideValue) : value(valueIn), original(valueIn) {
+            value = std::move(overrideValue);
+        }
+
+        ~ScopedOverride() {
+            value = original;
+        }
+
+    private:
+        T &value;
+        T original;
+    };
+
     void checkSparseMatrixEquality(const SparseMatrix<double> &a, const SparseMatrix<double> &b);
 
     faaslet::Faaslet execFunction(faabric::Message &msg, const std::string &expectedOutput = "");
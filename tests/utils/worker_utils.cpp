@@ -90,16 +90,16 @@ namespace tests {
 
     void checkMultipleExecutions(faabric::Message &msg, int nExecs) {
         module_cache::WasmModuleCache &registry = module_cache::getWasmModuleCache();
-        wasm::WAVMWasmModule &cachedModule = registry.getCachedModule(msg);
+        std::shared_ptr<wasm::WAVMWasmModule> cachedModule = registry.getCachedModule(msg);
 
-        wasm::WAVMWasmModule module(cachedModule);
+        wasm::WAVMWasmModule module(*cachedModule);
 
         for (int i = 0; i < nExecs; i++) {
             bool success = module.execute(msg);
             REQUIRE(success);
 
             // Reset
-            module = cachedModule;
+            module = *cachedModule;
         }
     }
 